@@ -0,0 +1,17 @@
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+/*
+ * thin wrappers around the gcc/clang __atomic builtins, since we're stuck with c89
+ * loads acquire, stores release and read-modify-writes do both
+ */
+#define atomic_get(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define atomic_set(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define atomic_swap(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_ACQ_REL)
+#define atomic_or(ptr, val) __atomic_fetch_or((ptr), (val), __ATOMIC_ACQ_REL)
+#define atomic_add(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_ACQ_REL)
+/* stores desired if *ptr equals *expected, otherwise loads *ptr into *expected, returns true if it stored */
+#define atomic_cas(ptr, expected, desired) __atomic_compare_exchange_n((ptr), (expected), (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#endif /* ATOMIC_H */
@@ -0,0 +1,307 @@
+#include "audio.h"
+#include "atomic.h"
+#include "emulator.h"
+#include "trace.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifndef DISABLE_AUDIO
+static int audio_open_device(audio * a, const char * name, size_t device_bytes)
+{
+#if defined(__linux__)
+	pa_sample_spec params;
+	pa_buffer_attr attr;
+	int error;
+	params.format = PA_SAMPLE_S16LE;
+	params.channels = a->channels;
+	params.rate = a->rate;
+	attr.maxlength = (uint32_t) -1;
+	attr.tlength = device_bytes;
+	attr.prebuf = (uint32_t) -1;
+	attr.minreq = (uint32_t) -1;
+	attr.fragsize = (uint32_t) -1;
+	a->device = pa_simple_new(NULL, name, PA_STREAM_PLAYBACK, NULL, "audio", &params, NULL, &attr, &error);
+	if (!a->device)
+	{
+		warn("unable to create audio device: %s\n", pa_strerror(error));
+		return 0;
+	}
+	return 1;
+#elif defined(__OpenBSD__)
+	struct sio_par params;
+	(void) name;
+	a->device = sio_open(SIO_DEVANY, SIO_PLAY, 0);
+	if (!a->device)
+	{
+		warn("unable to open audio device\n");
+		return 0;
+	}
+	sio_initpar(&params);
+	params.bits = 16;
+	params.bps = SIO_BPS(16);
+	params.le = SIO_LE_NATIVE;
+	params.pchan = a->channels;
+	params.rate = a->rate;
+	params.appbufsz = device_bytes / a->frame_bytes;
+	params.xrun = SIO_IGNORE;
+	if (!sio_setpar(a->device, &params))
+	{
+		warn("unable to set audio properties\n");
+		sio_close(a->device);
+		return 0;
+	}
+	if (!sio_start(a->device))
+	{
+		warn("unable to start audio device\n");
+		sio_close(a->device);
+		return 0;
+	}
+	return 1;
+#else
+	(void) a;
+	(void) name;
+	(void) device_bytes;
+	return 0;
+#endif
+}
+
+static void audio_write_device(audio * a, const void * data, size_t bytes)
+{
+#if defined(__linux__)
+	int error;
+	pa_simple_write(a->device, data, bytes, &error);
+#elif defined(__OpenBSD__)
+	sio_write(a->device, data, bytes);
+#else
+	(void) a;
+	(void) data;
+	(void) bytes;
+#endif
+}
+
+static void audio_close_device(audio * a)
+{
+#if defined(__linux__)
+	int error;
+	pa_simple_drain(a->device, &error);
+	pa_simple_free(a->device);
+#elif defined(__OpenBSD__)
+	sio_stop(a->device);
+	sio_close(a->device);
+#else
+	(void) a;
+#endif
+}
+
+static void * audio_thread(void * arg)
+{
+	audio * a = (audio *) arg;
+	size_t bytes;
+	trace_thread_name("audio");
+	while (!atomic_get(&a->quit))
+	{
+		/* blocking on the device here is what paces this thread */
+		bytes = ring_buffer_read(&a->ring, a->chunk, a->chunk_bytes);
+		bytes -= bytes % a->frame_bytes;
+		if (bytes == 0)
+		{
+			/* keep the device fed with silence rather than letting it stall */
+			if (atomic_get(&a->primed))
+			{
+				atomic_add(&a->underruns, 1);
+			}
+			memset(a->chunk, 0, a->chunk_bytes);
+			bytes = a->chunk_bytes;
+		}
+		TRACE_BEGIN("audio_write");
+		audio_write_device(a, a->chunk, bytes);
+		TRACE_END("audio_write");
+	}
+	return NULL;
+}
+#endif
+
+int audio_init(audio * a, const char * name, unsigned int rate, unsigned int channels, unsigned int depth_ms)
+{
+	size_t depth_bytes;
+	size_t device_bytes;
+	size_t ring_bytes;
+	memset(a, 0, sizeof(audio));
+#ifndef DISABLE_AUDIO
+	a->rate = rate;
+	a->channels = channels;
+	a->frame_bytes = channels * sizeof(short);
+	depth_bytes = (size_t) rate * depth_ms / 1000 * a->frame_bytes;
+	/*
+	 * the device only gets room for a couple of small writes, so the ring buffer holds most of the queued audio,
+	 * and the two together hold no more than the depth asked for
+	 */
+	a->chunk_bytes = depth_bytes / 8 - depth_bytes / 8 % a->frame_bytes;
+	if (a->chunk_bytes < a->frame_bytes)
+	{
+		a->chunk_bytes = a->frame_bytes;
+	}
+	device_bytes = a->chunk_bytes * 2;
+	ring_bytes = depth_bytes - device_bytes;
+	a->target_bytes = ring_bytes / 2;
+	a->level = (double) a->target_bytes;
+	a->ratio = a->ratio_min = a->ratio_max = 1.0;
+	a->chunk = (unsigned char *) malloc(a->chunk_bytes);
+	if (!a->chunk)
+	{
+		warn("unable to alloc audio chunk buffer\n");
+		return 0;
+	}
+	if (!ring_buffer_init(&a->ring, ring_bytes))
+	{
+		warn("unable to alloc audio ring buffer\n");
+		goto cleanup_chunk;
+	}
+	if (!audio_open_device(a, name, device_bytes))
+	{
+		goto cleanup_ring;
+	}
+	if (pthread_create(&a->thread, NULL, audio_thread, a) != 0)
+	{
+		warn("unable to start audio thread\n");
+		audio_close_device(a);
+		goto cleanup_ring;
+	}
+	a->init = 1;
+	return 1;
+cleanup_ring:
+	ring_buffer_free(&a->ring);
+cleanup_chunk:
+	free(a->chunk);
+	a->chunk = NULL;
+	return 0;
+#else
+	(void) name;
+	(void) rate;
+	(void) channels;
+	(void) depth_ms;
+	(void) depth_bytes;
+	(void) device_bytes;
+	(void) ring_bytes;
+	return 0;
+#endif
+}
+
+void audio_queue(audio * a, const void * samples, size_t bytes)
+{
+	if (!a->init || bytes == 0)
+	{
+		return;
+	}
+	if (ring_buffer_space(&a->ring) < bytes)
+	{
+		atomic_add(&a->overruns, 1);
+		bytes = ring_buffer_space(&a->ring);
+		bytes -= bytes % a->frame_bytes;
+	}
+	ring_buffer_write(&a->ring, samples, bytes);
+	a->pending += bytes;
+	atomic_set(&a->primed, 1);
+}
+
+/*
+ * proportional control on the fill level, more audio when below target and less when above
+ * the level is read as it was before this frame's audio went in, which is what audio sync's wait brings back to target,
+ * and smoothed so one late frame doesn't swing the pitch
+ */
+static double audio_update_ratio(audio * a, size_t used)
+{
+	used = used > a->pending ? used - a->pending : 0;
+	a->pending = 0;
+	a->level += ((double) used - a->level) * AUDIO_DRC_SMOOTHING;
+	a->ratio = 1.0 + AUDIO_DRC_MAX_DEVIATION * ((double) a->target_bytes - a->level) / (double) a->target_bytes;
+	if (a->ratio > 1.0 + AUDIO_DRC_MAX_DEVIATION)
+	{
+		a->ratio = 1.0 + AUDIO_DRC_MAX_DEVIATION;
+	}
+	else if (a->ratio < 1.0 - AUDIO_DRC_MAX_DEVIATION)
+	{
+		a->ratio = 1.0 - AUDIO_DRC_MAX_DEVIATION;
+	}
+	if (a->ratio < a->ratio_min)
+	{
+		a->ratio_min = a->ratio;
+	}
+	if (a->ratio > a->ratio_max)
+	{
+		a->ratio_max = a->ratio;
+	}
+	return a->ratio;
+}
+
+double audio_sync(audio * a)
+{
+	size_t used;
+	size_t excess;
+	double ratio;
+	struct timespec ts;
+	if (!a->init)
+	{
+		return 1.0;
+	}
+	
+	/* the ratio comes from the level before waiting, so it sees the buffer above target as well as below */
+	used = ring_buffer_used(&a->ring);
+	ratio = audio_update_ratio(a, used);
+	
+	/* waiting is what paces emulation, holding the level at the controller's setpoint so the ratio settles at 1 */
+	if (used > a->target_bytes)
+	{
+		/*
+		 * sleep for as long as the device takes to play the excess, in one go, as the ring only drains a chunk
+		 * at a time and waiting for it to read back as on target would oversleep by up to a chunk
+		 */
+		excess = (used - a->target_bytes) / a->frame_bytes;
+		ts.tv_sec = excess / a->rate;
+		ts.tv_nsec = (long) ((excess % a->rate) * 1000000000UL / a->rate);
+		nanosleep(&ts, NULL);
+	}
+	return ratio;
+}
+
+double audio_rate_control(audio * a)
+{
+	if (!a->init)
+	{
+		return 1.0;
+	}
+	return audio_update_ratio(a, ring_buffer_used(&a->ring));
+}
+
+void audio_report(audio * a)
+{
+	if (!a->init)
+	{
+		printf("audio: no output\n");
+		return;
+	}
+	printf("audio: %lu underruns, %lu overruns, %lu ms queued\n",
+		atomic_get(&a->underruns),
+		atomic_get(&a->overruns),
+		(unsigned long) (ring_buffer_used(&a->ring) / a->frame_bytes * 1000 / a->rate)
+	);
+	printf("audio: resampling ratio min %.5f, max %.5f\n", a->ratio_min, a->ratio_max);
+}
+
+void audio_shutdown(audio * a)
+{
+	if (!a->init)
+	{
+		return;
+	}
+#ifndef DISABLE_AUDIO
+	atomic_set(&a->quit, 1);
+	pthread_join(a->thread, NULL);
+	audio_close_device(a);
+#endif
+	ring_buffer_free(&a->ring);
+	free(a->chunk);
+	a->chunk = NULL;
+	a->init = 0;
+}
@@ -0,0 +1,92 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stddef.h>
+
+#ifndef DISABLE_AUDIO
+#include <pthread.h>
+#if defined(__linux__)
+#include <pulse/simple.h>
+#include <pulse/error.h>
+#elif defined(__OpenBSD__)
+#include <sndio.h>
+#endif
+#endif
+
+#include "ring_buffer.h"
+
+#define AUDIO_DEFAULT_DEPTH_MS 60
+
+/* the most dynamic rate control may stretch or squash audio by, small enough to be inaudible */
+#define AUDIO_DRC_MAX_DEVIATION 0.005
+
+/* weight each new fill level reading gets in the smoothed level dynamic rate control works from */
+#define AUDIO_DRC_SMOOTHING 0.125
+
+/*
+ * audio output fed by a lock-free ring buffer, drained by its own thread
+ * so device latency and back-pressure never reach the emulation thread
+ */
+typedef struct audio
+{
+	int init;
+	unsigned int rate;
+	unsigned int channels;
+	size_t frame_bytes; /* bytes per sample frame */
+	size_t chunk_bytes; /* bytes written to the device at a time */
+	size_t target_bytes; /* fill level audio sync aims for */
+	size_t pending; /* bytes queued since the last rate control update */
+	double level; /* smoothed fill level before each frame's audio, in bytes */
+	double ratio; /* last dynamic rate control ratio */
+	double ratio_min;
+	double ratio_max;
+	unsigned char * chunk;
+	ring_buffer ring;
+	unsigned long underruns; /* atomic, times the device needed data the ring didn't have */
+	unsigned long overruns; /* atomic, times the ring was too full to take a whole frame of audio */
+	int primed; /* atomic, set once the first samples have been queued */
+	int quit; /* atomic */
+#ifndef DISABLE_AUDIO
+	pthread_t thread;
+#if defined(__linux__)
+	pa_simple * device;
+#elif defined(__OpenBSD__)
+	struct sio_hdl * device;
+#endif
+#endif
+} audio;
+
+/*
+ * opens the audio device for signed 16-bit little-endian samples and starts the output thread
+ * depth_ms is how much audio the ring buffer and the device's own buffer can hold between them
+ * returns true on success, otherwise false, in which case queued audio is discarded
+ */
+int audio_init(audio * a, const char * name, unsigned int rate, unsigned int channels, unsigned int depth_ms);
+
+/*
+ * queues samples for output without blocking
+ * anything that doesn't fit in the ring buffer is dropped and counted as an overrun
+ */
+void audio_queue(audio * a, const void * samples, size_t bytes);
+
+/*
+ * audio sync: lets the audio device act as the master clock, waiting until the queued audio is back down to the
+ * target level (half the ring buffer), never blocking on the device, and resampling only if the level still falls short
+ * returns the ratio the next frame of audio should be resampled by so the level stays on target
+ */
+double audio_sync(audio * a);
+
+/*
+ * dynamic rate control alone, for when something else sets the pace: never waits
+ * returns the ratio the next frame of audio should be resampled by to bring the queued audio back to the target level
+ */
+double audio_rate_control(audio * a);
+
+/*
+ * prints the underrun and overrun counts
+ */
+void audio_report(audio * a);
+
+void audio_shutdown(audio * a);
+
+#endif /* AUDIO_H */
@@ -0,0 +1,113 @@
+#include "bench.h"
+#include "timing.h"
+
+#include <string.h>
+
+#define BENCH_DEFAULT_CAPACITY 4096
+
+static int bench_compare(const void * a, const void * b)
+{
+	const uint64_t x = *(const uint64_t *) a;
+	const uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+int bench_init(bench * b, size_t expected_frames)
+{
+	memset(b, 0, sizeof(bench));
+	b->capacity = expected_frames > 0 ? expected_frames : BENCH_DEFAULT_CAPACITY;
+	b->samples = (uint64_t *) malloc(b->capacity * sizeof(uint64_t));
+	if (!b->samples)
+	{
+		b->capacity = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void bench_begin(bench * b)
+{
+	b->start = timing_now();
+	b->end = b->start;
+}
+
+void bench_end(bench * b)
+{
+	b->end = timing_now();
+}
+
+void bench_add(bench * b, uint64_t ns)
+{
+	if (b->count == b->capacity)
+	{
+		/* grow outside of the preallocated range, dropping the sample if that fails */
+		size_t capacity = b->capacity > 0 ? b->capacity * 2 : BENCH_DEFAULT_CAPACITY;
+		uint64_t * tmp = (uint64_t *) realloc(b->samples, capacity * sizeof(uint64_t));
+		if (!tmp)
+		{
+			return;
+		}
+		b->samples = tmp;
+		b->capacity = capacity;
+	}
+	b->samples[b->count++] = ns;
+}
+
+void bench_report(bench * b)
+{
+	size_t i;
+	uint64_t total;
+	double wall;
+	double mean;
+	double p99;
+	
+	if (b->count == 0)
+	{
+		printf("bench: no frames recorded\n");
+		return;
+	}
+	
+	total = 0;
+	for (i = 0; i < b->count; i++)
+	{
+		total += b->samples[i];
+	}
+	qsort(b->samples, b->count, sizeof(uint64_t), bench_compare);
+	
+	wall = (double) (b->end - b->start) / BILLION;
+	mean = (double) total / b->count;
+	p99 = (double) b->samples[(b->count * 99 - 1) / 100];
+	
+	printf("bench: %lu frames in %.3f s wall time\n", (unsigned long) b->count, wall);
+	printf("bench: %.2f fps\n", wall > 0.0 ? b->count / wall : 0.0);
+	printf("bench: frame time mean %.3f ms, p99 %.3f ms, min %.3f ms, max %.3f ms\n",
+		mean / 1000000.0,
+		p99 / 1000000.0,
+		(double) b->samples[0] / 1000000.0,
+		(double) b->samples[b->count - 1] / 1000000.0
+	);
+}
+
+double bench_mean(bench * b)
+{
+	size_t i;
+	uint64_t total;
+	
+	if (b->count == 0)
+	{
+		return 0.0;
+	}
+	total = 0;
+	for (i = 0; i < b->count; i++)
+	{
+		total += b->samples[i];
+	}
+	return (double) total / b->count;
+}
+
+void bench_free(bench * b)
+{
+	free(b->samples);
+	b->samples = NULL;
+	b->count = b->capacity = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef struct bench
+{
+	uint64_t * samples; /* per-frame times in nanoseconds */
+	size_t count;
+	size_t capacity;
+	uint64_t start;
+	uint64_t end;
+} bench;
+
+/*
+ * prepares a benchmark for use, preallocating room for expected_frames samples
+ * (0 if unknown, the sample buffer grows as needed)
+ * returns true on success, otherwise false
+ */
+int bench_init(bench * b, size_t expected_frames);
+
+/*
+ * marks the start and end of the measured run for wall time purposes
+ */
+void bench_begin(bench * b);
+void bench_end(bench * b);
+
+/*
+ * records the time taken by a single frame
+ */
+void bench_add(bench * b, uint64_t ns);
+
+/*
+ * prints frames/second, mean/p99 frame time and total wall time
+ */
+void bench_report(bench * b);
+
+/*
+ * gets the mean frame time in nanoseconds, 0 if nothing was recorded
+ */
+double bench_mean(bench * b);
+
+void bench_free(bench * b);
+
+#endif /* BENCH_H */
@@ -0,0 +1,458 @@
+#include "convert.h"
+#include "timing.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if !defined(DISABLE_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+#define CONVERT_BENCH_LINES 200000
+
+typedef uint32_t (* convert_kernel)(void * dst, const cc_u8l * src, const uint32_t * palette, size_t count);
+
+uint32_t convert_lut_argb[CONVERT_COLOR_COUNT];
+uint32_t convert_lut[CONVERT_COLOR_COUNT];
+unsigned int convert_pixel_bytes;
+
+static uint32_t convert_fold(const uint32_t * lanes)
+{
+	uint32_t hash = CONVERT_HASH_BASIS;
+	int i;
+	for (i = 0; i < CONVERT_HASH_LANES; i++)
+	{
+		hash = (hash ^ lanes[i]) * CONVERT_HASH_PRIME;
+	}
+	return hash;
+}
+
+uint32_t convert_hash(const void * data, size_t bytes)
+{
+	uint32_t lanes[CONVERT_HASH_LANES];
+	const unsigned char * p = (const unsigned char *) data;
+	uint32_t word;
+	size_t i;
+	
+	for (i = 0; i < CONVERT_HASH_LANES; i++)
+	{
+		lanes[i] = CONVERT_HASH_BASIS;
+	}
+	for (i = 0; i + sizeof(word) <= bytes; i += sizeof(word))
+	{
+		memcpy(&word, p + i, sizeof(word));
+		lanes[i / sizeof(word) % CONVERT_HASH_LANES] = (lanes[i / sizeof(word) % CONVERT_HASH_LANES] ^ word) * CONVERT_HASH_PRIME;
+	}
+	for (word = 0; i < bytes; i++)
+	{
+		word = word << 8 | p[i];
+	}
+	lanes[0] = (lanes[0] ^ word ^ (uint32_t) bytes) * CONVERT_HASH_PRIME;
+	return convert_fold(lanes);
+}
+
+static uint32_t convert_line_scalar(void * dst, const cc_u8l * src, const uint32_t * palette, size_t count)
+{
+	uint32_t lanes[CONVERT_HASH_LANES];
+	uint32_t * out = (uint32_t *) dst;
+	uint32_t pixel;
+	size_t i;
+	
+	for (i = 0; i < CONVERT_HASH_LANES; i++)
+	{
+		lanes[i] = CONVERT_HASH_BASIS;
+	}
+	for (i = 0; i < count; i++)
+	{
+		pixel = palette[src[i]];
+		out[i] = pixel;
+		lanes[i % CONVERT_HASH_LANES] = (lanes[i % CONVERT_HASH_LANES] ^ pixel) * CONVERT_HASH_PRIME;
+	}
+	return convert_fold(lanes);
+}
+
+static uint32_t convert_line_scalar16(void * dst, const cc_u8l * src, const uint32_t * palette, size_t count)
+{
+	uint32_t lanes[CONVERT_HASH_LANES];
+	uint16_t * out = (uint16_t *) dst;
+	uint32_t pixel;
+	size_t i;
+	
+	for (i = 0; i < CONVERT_HASH_LANES; i++)
+	{
+		lanes[i] = CONVERT_HASH_BASIS;
+	}
+	for (i = 0; i < count; i++)
+	{
+		pixel = palette[src[i]];
+		out[i] = (uint16_t) pixel;
+		lanes[i % CONVERT_HASH_LANES] = (lanes[i % CONVERT_HASH_LANES] ^ pixel) * CONVERT_HASH_PRIME;
+	}
+	return convert_fold(lanes);
+}
+
+#ifdef CONVERT_X86
+/*
+ * sse4.1 has no gather, so the palette lookups stay scalar,
+ * but the stores and the hash (which needs pmulld) are done 4 lanes at a time
+ */
+__attribute__((target("sse4.1")))
+static uint32_t convert_line_sse4(void * dst, const cc_u8l * src, const uint32_t * palette, size_t count)
+{
+	uint32_t lanes[CONVERT_HASH_LANES];
+	uint32_t * out = (uint32_t *) dst;
+	const __m128i prime = _mm_set1_epi32((int) CONVERT_HASH_PRIME);
+	__m128i lo = _mm_set1_epi32((int) CONVERT_HASH_BASIS);
+	__m128i hi = lo;
+	__m128i a;
+	__m128i b;
+	uint32_t pixel;
+	size_t i;
+	
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		a = _mm_set_epi32((int) palette[src[i + 3]], (int) palette[src[i + 2]], (int) palette[src[i + 1]], (int) palette[src[i]]);
+		b = _mm_set_epi32((int) palette[src[i + 7]], (int) palette[src[i + 6]], (int) palette[src[i + 5]], (int) palette[src[i + 4]]);
+		_mm_storeu_si128((__m128i *) (out + i), a);
+		_mm_storeu_si128((__m128i *) (out + i + 4), b);
+		lo = _mm_mullo_epi32(_mm_xor_si128(lo, a), prime);
+		hi = _mm_mullo_epi32(_mm_xor_si128(hi, b), prime);
+	}
+	_mm_storeu_si128((__m128i *) lanes, lo);
+	_mm_storeu_si128((__m128i *) (lanes + 4), hi);
+	for (; i < count; i++)
+	{
+		pixel = palette[src[i]];
+		out[i] = pixel;
+		lanes[i % CONVERT_HASH_LANES] = (lanes[i % CONVERT_HASH_LANES] ^ pixel) * CONVERT_HASH_PRIME;
+	}
+	return convert_fold(lanes);
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t convert_line_sse4_16(void * dst, const cc_u8l * src, const uint32_t * palette, size_t count)
+{
+	uint32_t lanes[CONVERT_HASH_LANES];
+	uint16_t * out = (uint16_t *) dst;
+	const __m128i prime = _mm_set1_epi32((int) CONVERT_HASH_PRIME);
+	__m128i lo = _mm_set1_epi32((int) CONVERT_HASH_BASIS);
+	__m128i hi = lo;
+	__m128i a;
+	__m128i b;
+	uint32_t pixel;
+	size_t i;
+	
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		a = _mm_set_epi32((int) palette[src[i + 3]], (int) palette[src[i + 2]], (int) palette[src[i + 1]], (int) palette[src[i]]);
+		b = _mm_set_epi32((int) palette[src[i + 7]], (int) palette[src[i + 6]], (int) palette[src[i + 5]], (int) palette[src[i + 4]]);
+		_mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi32(a, b));
+		lo = _mm_mullo_epi32(_mm_xor_si128(lo, a), prime);
+		hi = _mm_mullo_epi32(_mm_xor_si128(hi, b), prime);
+	}
+	_mm_storeu_si128((__m128i *) lanes, lo);
+	_mm_storeu_si128((__m128i *) (lanes + 4), hi);
+	for (; i < count; i++)
+	{
+		pixel = palette[src[i]];
+		out[i] = (uint16_t) pixel;
+		lanes[i % CONVERT_HASH_LANES] = (lanes[i % CONVERT_HASH_LANES] ^ pixel) * CONVERT_HASH_PRIME;
+	}
+	return convert_fold(lanes);
+}
+
+/* widens 8 indices at a time and gathers their pixels straight out of the palette */
+__attribute__((target("avx2")))
+static uint32_t convert_line_avx2(void * dst, const cc_u8l * src, const uint32_t * palette, size_t count)
+{
+	uint32_t lanes[CONVERT_HASH_LANES];
+	uint32_t * out = (uint32_t *) dst;
+	const __m256i prime = _mm256_set1_epi32((int) CONVERT_HASH_PRIME);
+	__m256i hash = _mm256_set1_epi32((int) CONVERT_HASH_BASIS);
+	__m256i pixels;
+	uint32_t pixel;
+	size_t i;
+	
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		pixels = _mm256_i32gather_epi32((const int *) palette, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + i))), 4);
+		_mm256_storeu_si256((__m256i *) (out + i), pixels);
+		hash = _mm256_mullo_epi32(_mm256_xor_si256(hash, pixels), prime);
+	}
+	_mm256_storeu_si256((__m256i *) lanes, hash);
+	for (; i < count; i++)
+	{
+		pixel = palette[src[i]];
+		out[i] = pixel;
+		lanes[i % CONVERT_HASH_LANES] = (lanes[i % CONVERT_HASH_LANES] ^ pixel) * CONVERT_HASH_PRIME;
+	}
+	return convert_fold(lanes);
+}
+
+__attribute__((target("avx2")))
+static uint32_t convert_line_avx2_16(void * dst, const cc_u8l * src, const uint32_t * palette, size_t count)
+{
+	uint32_t lanes[CONVERT_HASH_LANES];
+	uint16_t * out = (uint16_t *) dst;
+	const __m256i prime = _mm256_set1_epi32((int) CONVERT_HASH_PRIME);
+	__m256i hash = _mm256_set1_epi32((int) CONVERT_HASH_BASIS);
+	__m256i pixels;
+	uint32_t pixel;
+	size_t i;
+	
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		pixels = _mm256_i32gather_epi32((const int *) palette, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + i))), 4);
+		_mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi32(_mm256_castsi256_si128(pixels), _mm256_extracti128_si256(pixels, 1)));
+		hash = _mm256_mullo_epi32(_mm256_xor_si256(hash, pixels), prime);
+	}
+	_mm256_storeu_si256((__m256i *) lanes, hash);
+	for (; i < count; i++)
+	{
+		pixel = palette[src[i]];
+		out[i] = (uint16_t) pixel;
+		lanes[i % CONVERT_HASH_LANES] = (lanes[i % CONVERT_HASH_LANES] ^ pixel) * CONVERT_HASH_PRIME;
+	}
+	return convert_fold(lanes);
+}
+#endif
+
+convert_kernel convert_line = convert_line_scalar;
+
+#if defined(CONVERT_X86) && defined(__SSE2__)
+/* sse2 is always there on x86-64, so nearest-neighbour expansion needs no dispatch */
+static size_t convert_scale_line_sse2(void * dst, const void * src, size_t count, unsigned int scale)
+{
+	const __m128i * in = (const __m128i *) src;
+	__m128i * out = (__m128i *) dst;
+	__m128i v;
+	size_t i;
+	size_t blocks;
+	
+	if (convert_pixel_bytes == 4)
+	{
+		blocks = count / 4;
+		for (i = 0; i < blocks; i++)
+		{
+			v = _mm_loadu_si128(in + i);
+			switch (scale)
+			{
+				case 2:
+					_mm_storeu_si128(out++, _mm_unpacklo_epi32(v, v));
+					_mm_storeu_si128(out++, _mm_unpackhi_epi32(v, v));
+					break;
+				case 3:
+					_mm_storeu_si128(out++, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+					_mm_storeu_si128(out++, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+					_mm_storeu_si128(out++, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+					break;
+				case 4:
+					_mm_storeu_si128(out++, _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 0, 0, 0)));
+					_mm_storeu_si128(out++, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 1, 1, 1)));
+					_mm_storeu_si128(out++, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 2, 2)));
+					_mm_storeu_si128(out++, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3)));
+					break;
+				default:
+					return 0;
+			}
+		}
+		return blocks * 4;
+	}
+	
+	/* 16-bit 3x needs a byte shuffle, so it's left to the scalar loop */
+	if (scale != 2 && scale != 4)
+	{
+		return 0;
+	}
+	blocks = count / 8;
+	for (i = 0; i < blocks; i++)
+	{
+		__m128i lo;
+		__m128i hi;
+		v = _mm_loadu_si128(in + i);
+		lo = _mm_unpacklo_epi16(v, v);
+		hi = _mm_unpackhi_epi16(v, v);
+		if (scale == 2)
+		{
+			_mm_storeu_si128(out++, lo);
+			_mm_storeu_si128(out++, hi);
+		}
+		else
+		{
+			_mm_storeu_si128(out++, _mm_unpacklo_epi32(lo, lo));
+			_mm_storeu_si128(out++, _mm_unpackhi_epi32(lo, lo));
+			_mm_storeu_si128(out++, _mm_unpacklo_epi32(hi, hi));
+			_mm_storeu_si128(out++, _mm_unpackhi_epi32(hi, hi));
+		}
+	}
+	return blocks * 8;
+}
+#endif
+
+void convert_scale_line(void * dst, const void * src, size_t count, unsigned int scale)
+{
+	size_t i = 0;
+	unsigned int k;
+	
+#if defined(CONVERT_X86) && defined(__SSE2__)
+	i = convert_scale_line_sse2(dst, src, count, scale);
+#endif
+	if (convert_pixel_bytes == 4)
+	{
+		const uint32_t * in = (const uint32_t *) src;
+		uint32_t * out = (uint32_t *) dst + i * scale;
+		for (; i < count; i++)
+		{
+			for (k = 0; k < scale; k++)
+			{
+				*out++ = in[i];
+			}
+		}
+	}
+	else
+	{
+		const uint16_t * in = (const uint16_t *) src;
+		uint16_t * out = (uint16_t *) dst + i * scale;
+		for (; i < count; i++)
+		{
+			for (k = 0; k < scale; k++)
+			{
+				*out++ = in[i];
+			}
+		}
+	}
+}
+
+/* scales a 4-bit channel to fill mask */
+static uint32_t convert_channel(uint32_t value, uint32_t mask)
+{
+	uint32_t shift = 0;
+	uint32_t max;
+	while (mask && !(mask & 1))
+	{
+		mask >>= 1;
+		shift++;
+	}
+	max = mask;
+	return (value * max + 7) / 15 << shift;
+}
+
+const char * convert_set_format(unsigned int bytes_per_pixel, uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask)
+{
+	uint32_t color;
+	uint32_t unused;
+	
+	if (bytes_per_pixel != 2 && bytes_per_pixel != 4)
+	{
+		return NULL;
+	}
+	
+	/* whatever isn't a colour channel in a 32-bit pixel is alpha, so keep it opaque */
+	unused = bytes_per_pixel == 4 ? ~(red_mask | green_mask | blue_mask) : 0;
+	for (color = 0; color < CONVERT_COLOR_COUNT; color++)
+	{
+		convert_lut[color] = unused | convert_channel(color & 0xF, red_mask) | convert_channel(color >> 4 & 0xF, green_mask) | convert_channel(color >> 8 & 0xF, blue_mask);
+	}
+	convert_pixel_bytes = bytes_per_pixel;
+	
+#ifdef CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		convert_line = bytes_per_pixel == 4 ? convert_line_avx2 : convert_line_avx2_16;
+		return "avx2";
+	}
+	if (__builtin_cpu_supports("sse4.1"))
+	{
+		convert_line = bytes_per_pixel == 4 ? convert_line_sse4 : convert_line_sse4_16;
+		return "sse4.1";
+	}
+#endif
+	convert_line = bytes_per_pixel == 4 ? convert_line_scalar : convert_line_scalar16;
+	return "scalar";
+}
+
+const char * convert_init(void)
+{
+	const char * kernel = convert_set_format(4, 0xFF0000, 0xFF00, 0xFF);
+	memcpy(convert_lut_argb, convert_lut, sizeof(convert_lut));
+	return kernel;
+}
+
+/* the conversion as it was before the lookup table and kernels, with a serial hash */
+static uint32_t convert_line_reference(void * dst, const cc_u8l * src, const uint32_t * palette, size_t count)
+{
+	uint32_t hash = CONVERT_HASH_BASIS;
+	uint32_t * out = (uint32_t *) dst;
+	uint32_t pixel;
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		pixel = palette[*src++];
+		*out++ = pixel;
+		hash = (hash ^ pixel) * CONVERT_HASH_PRIME;
+	}
+	return hash;
+}
+
+static void convert_benchmark_kernel(const char * name, convert_kernel kernel, void * dst, const cc_u8l * src, const uint32_t * palette)
+{
+	static const size_t widths[3] = { 256, 320, VDP_MAX_SCANLINE_WIDTH };
+	volatile uint32_t sink;
+	uint64_t start;
+	uint64_t elapsed;
+	size_t w;
+	long line;
+	
+	printf("convert: %-12s", name);
+	for (w = 0; w < 3; w++)
+	{
+		sink = 0;
+		start = timing_now();
+		for (line = 0; line < CONVERT_BENCH_LINES; line++)
+		{
+			sink ^= kernel(dst, src + (line & 63), palette, widths[w]);
+		}
+		elapsed = timing_now() - start;
+		(void) sink;
+		printf("  %3lu px %6.3f px/ns", (unsigned long) widths[w], (double) widths[w] * CONVERT_BENCH_LINES / (elapsed > 0 ? elapsed : 1));
+	}
+	printf("\n");
+}
+
+void convert_benchmark(void)
+{
+	static cc_u8l src[VDP_MAX_SCANLINE_WIDTH + 64];
+	static uint32_t dst[VDP_MAX_SCANLINE_WIDTH];
+	static uint32_t palette[VDP_TOTAL_COLOURS];
+	uint32_t seed = 1;
+	size_t i;
+	
+	convert_init();
+	for (i = 0; i < VDP_TOTAL_COLOURS; i++)
+	{
+		palette[i] = convert_lut[(i * 0x2F1) & 0xFFF];
+	}
+	for (i = 0; i < sizeof(src) / sizeof(src[0]); i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		src[i] = (cc_u8l) ((seed >> 16) % VDP_TOTAL_COLOURS);
+	}
+	
+	convert_benchmark_kernel("reference", convert_line_reference, dst, src, palette);
+	convert_benchmark_kernel("scalar", convert_line_scalar, dst, src, palette);
+	convert_benchmark_kernel("scalar 16", convert_line_scalar16, dst, src, palette);
+#ifdef CONVERT_X86
+	if (__builtin_cpu_supports("sse4.1"))
+	{
+		convert_benchmark_kernel("sse4.1", convert_line_sse4, dst, src, palette);
+		convert_benchmark_kernel("sse4.1 16", convert_line_sse4_16, dst, src, palette);
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		convert_benchmark_kernel("avx2", convert_line_avx2, dst, src, palette);
+		convert_benchmark_kernel("avx2 16", convert_line_avx2_16, dst, src, palette);
+	}
+#endif
+}
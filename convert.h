@@ -0,0 +1,66 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/core/source/clownmdemu.h"
+
+/* the core hands over colours as 4 bits per channel, 0x0BGR */
+#define CONVERT_COLOR_COUNT 0x1000
+
+/* turns an ARGB8888 pixel made by convert_lut_argb back into the core colour it came from */
+#define CONVERT_ARGB_TO_COLOR(p) (((p) >> 16 & 0xF) | ((p) >> 4 & 0xF0) | ((p) << 8 & 0xF00))
+
+/*
+ * line hashes are FNV-1a run over 8 interleaved lanes, then folded together,
+ * so they can be computed 8 pixels at a time
+ */
+#define CONVERT_HASH_LANES 8
+#define CONVERT_HASH_BASIS 2166136261U
+#define CONVERT_HASH_PRIME 16777619U
+
+/* ARGB8888 pixel for each core colour, which is what palettes are saved as */
+extern uint32_t convert_lut_argb[CONVERT_COLOR_COUNT];
+
+/* output pixel for each core colour, in the format picked with convert_set_format() */
+extern uint32_t convert_lut[CONVERT_COLOR_COUNT];
+
+/* size of an output pixel, either 2 or 4 */
+extern unsigned int convert_pixel_bytes;
+
+/*
+ * expands count palette indices into output pixels, returning the hash of the pixels written
+ * picked from the fastest kernel the cpu supports for the output format
+ */
+extern uint32_t (* convert_line)(void * dst, const cc_u8l * src, const uint32_t * palette, size_t count);
+
+/*
+ * hashes bytes of data with the same lanes as the line hashes, a word per lane at a time
+ */
+uint32_t convert_hash(const void * data, size_t bytes);
+
+/*
+ * repeats each of count output pixels in src scale times across dst
+ */
+void convert_scale_line(void * dst, const void * src, size_t count, unsigned int scale);
+
+/*
+ * fills the colour tables for ARGB8888 output and picks the conversion kernel
+ * returns the name of the kernel in use
+ */
+const char * convert_init(void);
+
+/*
+ * switches output to pixels of bytes_per_pixel (2 or 4) bytes with the given channel masks,
+ * such as those of an X visual, regenerating the colour table and picking a kernel to match
+ * returns the name of the kernel in use, or NULL if the format isn't supported
+ */
+const char * convert_set_format(unsigned int bytes_per_pixel, uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask);
+
+/*
+ * prints pixels/ns for the original per-pixel loop and every kernel this cpu can run
+ */
+void convert_benchmark(void);
+
+#endif /* CONVERT_H */
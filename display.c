@@ -0,0 +1,727 @@
+#include "display.h"
+
+#include "atomic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* framebuffers are written as native integers, so images have to be tagged with the host's byte order */
+static int display_host_byte_order(void)
+{
+	const uint16_t probe = 1;
+	return *(const unsigned char *) &probe ? LSBFirst : MSBFirst;
+}
+
+/* finds a TrueColor visual of the requested depth, otherwise of the default depth, otherwise of the best depth there is */
+static int display_find_visual(display * d, int screen, int depth)
+{
+	static const int depths[] = { 24, 16, 15 };
+	size_t i;
+	if (depth > 0)
+	{
+		return XMatchVisualInfo(d->x_display, screen, depth, TrueColor, &d->vis_info);
+	}
+	if (XMatchVisualInfo(d->x_display, screen, DefaultDepth(d->x_display, screen), TrueColor, &d->vis_info))
+	{
+		return 1;
+	}
+	for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+	{
+		if (XMatchVisualInfo(d->x_display, screen, depths[i], TrueColor, &d->vis_info))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* gets the size of a pixel in images of the given depth, or 0 if it isn't known */
+static int display_bytes_per_pixel(display * d, int depth)
+{
+	XPixmapFormatValues * formats;
+	int count;
+	int i;
+	int bytes = 0;
+	formats = XListPixmapFormats(d->x_display, &count);
+	if (!formats)
+	{
+		return 0;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (formats[i].depth == depth)
+		{
+			bytes = formats[i].bits_per_pixel / 8;
+		}
+	}
+	XFree(formats);
+	return bytes;
+}
+
+#ifndef DISABLE_SHM
+static int shm_attach_failed; /* NOTE: global variable! */
+
+static int display_shm_error_handler(Display * x_display, XErrorEvent * ev)
+{
+	(void) x_display;
+	(void) ev;
+	shm_attach_failed = 1;
+	return 0;
+}
+
+static void display_destroy_shm_buffer(display * d, display_buffer * buf)
+{
+	if (buf->image)
+	{
+		XShmDetach(d->x_display, &buf->shm_info);
+		buf->image->data = NULL; /* not ours to free */
+		XDestroyImage(buf->image);
+		buf->image = NULL;
+	}
+	if (buf->shm_info.shmaddr && buf->shm_info.shmaddr != (char *) -1)
+	{
+		shmdt(buf->shm_info.shmaddr);
+	}
+	buf->shm_info.shmaddr = NULL;
+	buf->pixels = NULL;
+}
+
+static int display_create_shm_buffer(display * d, display_buffer * buf, size_t framebuffer_size)
+{
+	int (* old_handler)(Display *, XErrorEvent *);
+	
+	memset(buf, 0, sizeof(display_buffer));
+	buf->image = XShmCreateImage(d->x_display, d->vis_info.visual, d->vis_info.depth, ZPixmap, NULL, &buf->shm_info, d->width * d->scale, d->height * d->scale);
+	if (!buf->image)
+	{
+		return 0;
+	}
+	if ((size_t) (buf->image->bytes_per_line * buf->image->height) > framebuffer_size)
+	{
+		framebuffer_size = buf->image->bytes_per_line * buf->image->height;
+	}
+	buf->shm_info.shmid = shmget(IPC_PRIVATE, framebuffer_size, IPC_CREAT | 0600);
+	if (buf->shm_info.shmid < 0)
+	{
+		XDestroyImage(buf->image);
+		buf->image = NULL;
+		return 0;
+	}
+	buf->shm_info.shmaddr = (char *) shmat(buf->shm_info.shmid, NULL, 0);
+	if (buf->shm_info.shmaddr == (char *) -1)
+	{
+		shmctl(buf->shm_info.shmid, IPC_RMID, NULL);
+		XDestroyImage(buf->image);
+		buf->image = NULL;
+		return 0;
+	}
+	buf->image->data = buf->shm_info.shmaddr;
+	buf->image->byte_order = display_host_byte_order();
+	buf->shm_info.readOnly = False;
+	
+	/* attaching fails on remote displays even if the extension is reported as present */
+	shm_attach_failed = 0;
+	old_handler = XSetErrorHandler(display_shm_error_handler);
+	XShmAttach(d->x_display, &buf->shm_info);
+	XSync(d->x_display, False);
+	XSetErrorHandler(old_handler);
+	
+	/* the segment is destroyed once both we and the server have detached from it */
+	shmctl(buf->shm_info.shmid, IPC_RMID, NULL);
+	
+	if (shm_attach_failed)
+	{
+		/* don't detach a segment the server never attached */
+		buf->image->data = NULL;
+		XDestroyImage(buf->image);
+		buf->image = NULL;
+		shmdt(buf->shm_info.shmaddr);
+		buf->shm_info.shmaddr = NULL;
+		return 0;
+	}
+	buf->pixels = buf->shm_info.shmaddr;
+	return 1;
+}
+
+static int display_init_shm(display * d, size_t framebuffer_size)
+{
+	int i;
+	if (!XShmQueryExtension(d->x_display))
+	{
+		return 0;
+	}
+	for (i = 0; i < DISPLAY_BUFFER_COUNT; i++)
+	{
+		if (!display_create_shm_buffer(d, &d->buffers[i], framebuffer_size))
+		{
+			while (--i >= 0)
+			{
+				display_destroy_shm_buffer(d, &d->buffers[i]);
+			}
+			return 0;
+		}
+	}
+	d->shm_completion_event = XShmGetEventBase(d->x_display) + ShmCompletion;
+	return 1;
+}
+#endif
+
+#ifdef ENABLE_PRESENT
+static void display_destroy_present(display * d)
+{
+	int i;
+	for (i = 0; i < DISPLAY_PIXMAP_COUNT; i++)
+	{
+		if (d->pixmaps[i].pixmap)
+		{
+			XFreePixmap(d->x_display, d->pixmaps[i].pixmap);
+			d->pixmaps[i].pixmap = 0;
+		}
+		free(d->pixmaps[i].hash);
+		d->pixmaps[i].hash = NULL;
+	}
+}
+
+static int display_init_present(display * d)
+{
+	int event_base;
+	int error_base;
+	int i;
+	if (!XPresentQueryExtension(d->x_display, &d->present_opcode, &event_base, &error_base))
+	{
+		return 0;
+	}
+	for (i = 0; i < DISPLAY_PIXMAP_COUNT; i++)
+	{
+		d->pixmaps[i].hash = (uint32_t *) malloc(d->height * sizeof(uint32_t));
+		if (!d->pixmaps[i].hash)
+		{
+			display_destroy_present(d);
+			return 0;
+		}
+		d->pixmaps[i].pixmap = XCreatePixmap(d->x_display, d->window, d->window_width, d->window_height, d->vis_info.depth);
+	}
+	XPresentSelectInput(d->x_display, d->window, PresentCompleteNotifyMask | PresentIdleNotifyMask);
+	return 1;
+}
+#endif
+
+int display_init(display * d, int width, int height, int depth, int scale, int fullscreen, int present)
+{
+	int root;
+	int default_screen;
+	size_t framebuffer_size;
+	XSetWindowAttributes window_attr;
+	unsigned long attr_mask;
+	XSizeHints hints;
+	Atom wm_state;
+	Atom wm_fullscreen;
+	int i;
+	
+	memset(d, 0, sizeof(display));
+	d->width = width;
+	d->height = height;
+	d->shown_hash = (uint32_t *) malloc(height * sizeof(uint32_t));
+	if (!d->shown_hash)
+	{
+		printf("unable to alloc row hashes\n");
+		return 0;
+	}
+	
+	attr_mask = CWBackPixel | CWColormap | CWEventMask;
+	d->x_display = XOpenDisplay(0);
+	if (!d->x_display)
+	{
+		printf("unable to open display\n");
+		goto cleanup_hash;
+	}
+	root = DefaultRootWindow(d->x_display);
+	default_screen = DefaultScreen(d->x_display);
+	if (!display_find_visual(d, default_screen, depth))
+	{
+		printf("no matching visual info\n");
+		goto cleanup_x11_display;
+	}
+	d->bytes_per_pixel = display_bytes_per_pixel(d, d->vis_info.depth);
+	if (d->bytes_per_pixel != 2 && d->bytes_per_pixel != 4)
+	{
+		printf("unsupported pixel format, %d bits per pixel at depth %d\n", d->bytes_per_pixel * 8, d->vis_info.depth);
+		goto cleanup_x11_display;
+	}
+	
+	if (fullscreen)
+	{
+		d->window_width = DisplayWidth(d->x_display, default_screen);
+		d->window_height = DisplayHeight(d->x_display, default_screen);
+		if (scale == 0)
+		{
+			scale = d->window_width / width < d->window_height / height ? d->window_width / width : d->window_height / height;
+			scale = scale < 1 ? 1 : scale > DISPLAY_SCALE_MAX ? DISPLAY_SCALE_MAX : scale;
+		}
+	}
+	else
+	{
+		scale = scale > 0 ? scale : 1;
+		d->window_width = width * scale;
+		d->window_height = height * scale;
+	}
+	d->scale = scale;
+	framebuffer_size = (size_t) width * scale * height * scale * d->bytes_per_pixel;
+	
+	window_attr.background_pixel = 0;
+	window_attr.colormap = XCreateColormap(d->x_display, root, d->vis_info.visual, AllocNone);
+	window_attr.event_mask = KeyPressMask | KeyReleaseMask | ExposureMask;
+	d->window = XCreateWindow(d->x_display, root, 0, 0, d->window_width, d->window_height, 0, d->vis_info.depth, InputOutput, d->vis_info.visual, attr_mask, &window_attr);
+	if (!d->window)
+	{
+		printf("unable to create window\n");
+		goto cleanup_x11_display;
+	}
+	/* the default GC belongs to the root window, which may not have the depth of the visual we picked */
+	d->gc = XCreateGC(d->x_display, d->window, 0, NULL);
+	XStoreName(d->x_display, d->window, "clownmdemu");
+	if (fullscreen)
+	{
+		/* ask the window manager before mapping, so the window never shows up at its original size */
+		wm_state = XInternAtom(d->x_display, "_NET_WM_STATE", False);
+		wm_fullscreen = XInternAtom(d->x_display, "_NET_WM_STATE_FULLSCREEN", False);
+		XChangeProperty(d->x_display, d->window, wm_state, XA_ATOM, 32, PropModeReplace, (unsigned char *) &wm_fullscreen, 1);
+	}
+	else
+	{
+		hints.flags = PMinSize | PMaxSize;
+		hints.min_width = d->window_width;
+		hints.min_height = d->window_height;
+		hints.max_width = d->window_width;
+		hints.max_height = d->window_height;
+		XSetWMNormalHints(d->x_display, d->window, &hints);
+	}
+	XMapWindow(d->x_display, d->window);
+	XFlush(d->x_display);
+	
+#ifndef DISABLE_SHM
+	d->use_shm = display_init_shm(d, framebuffer_size);
+	if (!d->use_shm)
+	{
+		printf("MIT-SHM unavailable, falling back to XPutImage\n");
+	}
+#endif
+	if (!d->use_shm)
+	{
+		for (i = 0; i < DISPLAY_BUFFER_COUNT; i++)
+		{
+			d->buffers[i].pixels = malloc(framebuffer_size);
+			if (!d->buffers[i].pixels)
+			{
+				printf("unable to alloc internal framebuffer\n");
+				goto cleanup_x11_images;
+			}
+			d->buffers[i].image = XCreateImage(d->x_display, d->vis_info.visual, d->vis_info.depth, ZPixmap, 0, (char *) d->buffers[i].pixels, width * scale, height * scale, d->bytes_per_pixel * 8, 0);
+			if (!d->buffers[i].image)
+			{
+				printf("unable to create window image\n");
+				free(d->buffers[i].pixels);
+				d->buffers[i].pixels = NULL;
+				goto cleanup_x11_images;
+			}
+			d->buffers[i].image->byte_order = display_host_byte_order();
+		}
+	}
+	d->last_width = width;
+	d->last_height = height;
+	
+#ifdef ENABLE_PRESENT
+	if (present)
+	{
+		d->use_present = display_init_present(d);
+		if (!d->use_present)
+		{
+			printf("Present extension unavailable, falling back to unsynchronised drawing\n");
+		}
+	}
+#else
+	(void) present;
+#endif
+	
+	d->wm_delete_window = XInternAtom(d->x_display, "WM_DELETE_WINDOW", False);
+	if (!XSetWMProtocols(d->x_display, d->window, &d->wm_delete_window, 1))
+	{
+		printf("unable to intercept window close event\n");
+		display_shutdown(d);
+		return 0;
+	}
+	return 1;
+cleanup_x11_images:
+	while (--i >= 0)
+	{
+		XDestroyImage(d->buffers[i].image); /* also frees the pixels */
+		d->buffers[i].image = NULL;
+		d->buffers[i].pixels = NULL;
+	}
+	XFreeGC(d->x_display, d->gc);
+	XDestroyWindow(d->x_display, d->window);
+cleanup_x11_display:
+	XCloseDisplay(d->x_display);
+	d->x_display = NULL;
+cleanup_hash:
+	free(d->shown_hash);
+	d->shown_hash = NULL;
+	return 0;
+}
+
+void * display_get_framebuffer(display * d, int index)
+{
+	return d->buffers[index].pixels;
+}
+
+int display_is_busy(display * d, int index)
+{
+	return d->buffers[index].busy;
+}
+
+int display_needs_redraw(display * d)
+{
+	return !d->shown_valid;
+}
+
+static void display_put_rows(display * d, Drawable target, XImage * image, int first, int last, int x, int y, int send_event)
+{
+#ifndef DISABLE_SHM
+	if (d->use_shm)
+	{
+		XShmPutImage(d->x_display, target, d->gc, image, 0, first, x, y + first, image->width, last - first, send_event ? True : False);
+		return;
+	}
+#else
+	(void) send_event;
+#endif
+	XPutImage(d->x_display, target, d->gc, image, 0, first, x, y + first, image->width, last - first);
+}
+
+/*
+ * sends the rows whose hashes differ from target_hash to target, coalesced into ranges
+ * the last range is held back so that only the final request of the frame asks for a completion event
+ * returns true if anything was sent
+ */
+static int display_put_changed(display * d, Drawable target, uint32_t * target_hash, int target_valid, XImage * image, int height, const uint32_t * line_hash, int x, int y)
+{
+	int row;
+	int first;
+	int pending_first;
+	int pending_last;
+	
+	first = -1;
+	pending_first = pending_last = -1;
+	for (row = 0; row <= height; row++)
+	{
+		if (row < height && (!target_valid || target_hash[row] != line_hash[row]))
+		{
+			target_hash[row] = line_hash[row];
+			if (first < 0)
+			{
+				if (pending_first >= 0)
+				{
+					display_put_rows(d, target, image, pending_first * d->scale, pending_last * d->scale, x, y, 0);
+				}
+				first = row;
+			}
+		}
+		else if (first >= 0)
+		{
+			pending_first = first;
+			pending_last = row;
+			first = -1;
+		}
+	}
+	if (pending_first < 0)
+	{
+		return 0;
+	}
+	display_put_rows(d, target, image, pending_first * d->scale, pending_last * d->scale, x, y, 1);
+	return 1;
+}
+
+#ifdef ENABLE_PRESENT
+/* copies a frame into an idle pixmap and queues it for the next vblank */
+static int display_present_pixmap(display * d, XImage * image, int height, const uint32_t * line_hash, int x, int y, uint64_t frame_time)
+{
+	display_pixmap * pm = NULL;
+	int changed;
+	int i;
+	
+	changed = !d->shown_valid;
+	for (i = 0; i < height && !changed; i++)
+	{
+		changed = d->shown_hash[i] != line_hash[i];
+	}
+	if (!changed)
+	{
+		/* the window already shows this frame, so there's nothing to flip to */
+		return 0;
+	}
+	
+	for (i = 0; i < DISPLAY_PIXMAP_COUNT; i++)
+	{
+		if (!d->pixmaps[i].busy)
+		{
+			pm = &d->pixmaps[i];
+			break;
+		}
+	}
+	if (!pm)
+	{
+		/* every pixmap is on screen or queued, so the server is running behind us, try again once one is idle */
+		d->present_dropped++;
+		d->shown_valid = 0;
+		return 0;
+	}
+	
+	if (!pm->valid)
+	{
+		/* the previous frame may have been smaller or placed elsewhere */
+		XFillRectangle(d->x_display, pm->pixmap, d->gc, 0, 0, d->window_width, d->window_height);
+	}
+	changed = display_put_changed(d, pm->pixmap, pm->hash, pm->valid, image, height, line_hash, x, y);
+	pm->valid = 1;
+	memcpy(d->shown_hash, line_hash, height * sizeof(uint32_t));
+	d->shown_valid = 1;
+	
+	pm->busy = 1;
+	pm->serial = ++d->present_serial;
+	pm->frame_time = frame_time;
+	XPresentPixmap(d->x_display, d->window, pm->pixmap, pm->serial, None, None, 0, 0, None, None, None, PresentOptionNone, 0, 0, 0, NULL, 0);
+	XFlush(d->x_display);
+	return changed;
+}
+
+static void display_present_complete(display * d, XPresentCompleteNotifyEvent * ev)
+{
+	uint64_t shown = ev->ust * 1000;
+	uint64_t period;
+	uint64_t refresh;
+	uint64_t latency;
+	int i;
+	
+	d->presented++;
+	if (ev->mode == PresentCompleteModeSkip)
+	{
+		d->present_skipped++;
+	}
+	for (i = 0; i < DISPLAY_PIXMAP_COUNT; i++)
+	{
+		if (d->pixmaps[i].serial == ev->serial_number && d->pixmaps[i].frame_time && shown > d->pixmaps[i].frame_time)
+		{
+			latency = shown - d->pixmaps[i].frame_time;
+			d->latency_frames++;
+			d->latency_sum += latency;
+			if (latency > d->latency_max)
+			{
+				d->latency_max = latency;
+			}
+		}
+	}
+	
+	/* the refresh period is measured rather than taken from the mode line, which isn't always accurate */
+	if (d->last_msc && ev->msc > d->last_msc && ev->ust > d->last_ust)
+	{
+		period = (ev->ust - d->last_ust) * 1000 / (ev->msc - d->last_msc);
+		refresh = atomic_get(&d->refresh_ns);
+		refresh = refresh ? refresh + ((int64_t) (period - refresh)) / 8 : period;
+		atomic_set(&d->refresh_ns, refresh);
+	}
+	d->last_ust = ev->ust;
+	d->last_msc = ev->msc;
+	atomic_set(&d->vblank_ns, shown);
+}
+
+static int display_handle_present_event(display * d, XEvent * ev)
+{
+	XGenericEventCookie * cookie = &ev->xcookie;
+	int i;
+	if (ev->type != GenericEvent || cookie->extension != d->present_opcode)
+	{
+		return 0;
+	}
+	if (!XGetEventData(d->x_display, cookie))
+	{
+		return 1;
+	}
+	if (cookie->evtype == PresentCompleteNotify)
+	{
+		display_present_complete(d, (XPresentCompleteNotifyEvent *) cookie->data);
+	}
+	else if (cookie->evtype == PresentIdleNotify)
+	{
+		XPresentIdleNotifyEvent * ei = (XPresentIdleNotifyEvent *) cookie->data;
+		for (i = 0; i < DISPLAY_PIXMAP_COUNT; i++)
+		{
+			if (d->pixmaps[i].pixmap == ei->pixmap)
+			{
+				d->pixmaps[i].busy = 0;
+			}
+		}
+	}
+	XFreeEventData(d->x_display, cookie);
+	return 1;
+}
+#endif
+
+void display_present(display * d, int index, int width, int height, const uint32_t * line_hash, uint64_t frame_time)
+{
+	display_buffer * buf = &d->buffers[index];
+	XImage * image = buf->image;
+	int x;
+	int y;
+	int sent;
+#ifdef ENABLE_PRESENT
+	int i;
+#else
+	(void) frame_time;
+#endif
+	
+	if (height > d->height)
+	{
+		height = d->height;
+	}
+	if (width != d->last_width || height != d->last_height)
+	{
+#ifdef ENABLE_PRESENT
+		/* pixmaps get cleared as they're reused, clearing the window would only flash */
+		for (i = 0; i < DISPLAY_PIXMAP_COUNT; i++)
+		{
+			d->pixmaps[i].valid = 0;
+		}
+		if (!d->use_present)
+#endif
+		XClearWindow(d->x_display, d->window);
+		d->last_width = width;
+		d->last_height = height;
+		d->shown_valid = 0;
+	}
+	image->width = width * d->scale;
+	image->height = height * d->scale;
+	image->bytes_per_line = image->width * d->bytes_per_pixel;
+	x = (d->window_width - image->width) / 2;
+	y = (d->window_height - image->height) / 2;
+	
+#ifdef ENABLE_PRESENT
+	if (d->use_present)
+	{
+		sent = display_present_pixmap(d, image, height, line_hash, x, y, frame_time);
+	}
+	else
+#endif
+	{
+		sent = display_put_changed(d, d->window, d->shown_hash, d->shown_valid, image, height, line_hash, x, y);
+		d->shown_valid = 1;
+	}
+	if (!sent)
+	{
+		/* nothing changed, so the server never touches this buffer */
+		return;
+	}
+#ifndef DISABLE_SHM
+	if (d->use_shm)
+	{
+		buf->busy = 1;
+	}
+#endif
+	XFlush(d->x_display);
+}
+
+int display_handle_event(display * d, XEvent * ev)
+{
+	if (ev->type == Expose)
+	{
+		/* the window contents were lost, so the next frame has to be sent in full */
+		d->shown_valid = 0;
+		return 1;
+	}
+#ifndef DISABLE_SHM
+	if (d->use_shm && ev->type == d->shm_completion_event)
+	{
+		XShmCompletionEvent * ec = (XShmCompletionEvent *) ev;
+		int i;
+		for (i = 0; i < DISPLAY_BUFFER_COUNT; i++)
+		{
+			if (d->buffers[i].shm_info.shmseg == ec->shmseg)
+			{
+				d->buffers[i].busy = 0;
+			}
+		}
+		return 1;
+	}
+#endif
+#ifdef ENABLE_PRESENT
+	if (d->use_present)
+	{
+		return display_handle_present_event(d, ev);
+	}
+#endif
+	return 0;
+}
+
+void display_report(display * d)
+{
+#ifdef ENABLE_PRESENT
+	uint64_t refresh;
+	if (!d->use_present)
+	{
+		return;
+	}
+	refresh = atomic_get(&d->refresh_ns);
+	printf("present: %lu frames shown, %lu missed their vblank, %lu dropped for lack of a free pixmap\n", d->presented, d->present_skipped, d->present_dropped);
+	if (d->latency_frames)
+	{
+		printf("present: latency from frame end to scanout mean %.2f ms, max %.2f ms\n", d->latency_sum / d->latency_frames / 1e6, d->latency_max / 1e6);
+	}
+	if (refresh)
+	{
+		printf("present: measured refresh %.3f Hz\n", 1e9 / refresh);
+	}
+#else
+	(void) d;
+#endif
+}
+
+void display_shutdown(display * d)
+{
+	int i;
+	if (!d->x_display)
+	{
+		return;
+	}
+#ifndef DISABLE_SHM
+	if (d->use_shm)
+	{
+		/* make sure the server is done with the segments before they go away */
+		XSync(d->x_display, False);
+		for (i = 0; i < DISPLAY_BUFFER_COUNT; i++)
+		{
+			display_destroy_shm_buffer(d, &d->buffers[i]);
+		}
+	}
+	else
+#endif
+	{
+		for (i = 0; i < DISPLAY_BUFFER_COUNT; i++)
+		{
+			XDestroyImage(d->buffers[i].image); /* also frees the pixels */
+			d->buffers[i].image = NULL;
+			d->buffers[i].pixels = NULL;
+		}
+	}
+#ifdef ENABLE_PRESENT
+	if (d->use_present)
+	{
+		display_destroy_present(d);
+	}
+#endif
+	XFreeGC(d->x_display, d->gc);
+	XDestroyWindow(d->x_display, d->window);
+	XCloseDisplay(d->x_display);
+	d->x_display = NULL;
+	free(d->shown_hash);
+	d->shown_hash = NULL;
+}
@@ -0,0 +1,139 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stdint.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
+#include <X11/XKBlib.h>
+
+#ifndef DISABLE_SHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
+
+#ifdef ENABLE_PRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
+
+/* one buffer each for the emulator to draw into, the newest complete frame and the server to read */
+#define DISPLAY_BUFFER_COUNT 3
+
+/* largest integer scale factor */
+#define DISPLAY_SCALE_MAX 4
+
+/* pixmaps handed to the Present extension, one on screen, one queued for the next vblank and one being filled */
+#define DISPLAY_PIXMAP_COUNT 3
+
+typedef struct display_buffer
+{
+	XImage * image;
+	void * pixels;
+#ifndef DISABLE_SHM
+	XShmSegmentInfo shm_info;
+#endif
+	int busy; /* server has not yet finished reading this buffer */
+} display_buffer;
+
+#ifdef ENABLE_PRESENT
+typedef struct display_pixmap
+{
+	Pixmap pixmap;
+	uint32_t * hash; /* hash of each row the pixmap holds */
+	int valid; /* false when the pixmap has to be cleared and filled in full */
+	int busy; /* presented, and the server hasn't said it's idle yet */
+	uint32_t serial; /* of the last present */
+	uint64_t frame_time; /* when the frame in it was finished, CLOCK_MONOTONIC nanoseconds */
+} display_pixmap;
+#endif
+
+typedef struct display
+{
+	Display * x_display;
+	Window window;
+	GC gc;
+	XVisualInfo vis_info;
+	Atom wm_delete_window;
+	int width; /* largest frame, before scaling */
+	int height;
+	int scale; /* frames are drawn this many times their size in each direction */
+	int window_width;
+	int window_height;
+	int bytes_per_pixel; /* of the visual's pixmap format, 2 or 4 */
+	int use_shm;
+	int shm_completion_event;
+	int last_width;
+	int last_height;
+	uint32_t * shown_hash; /* hash of each row currently in the window */
+	int shown_valid; /* false when the whole window needs to be redrawn */
+	display_buffer buffers[DISPLAY_BUFFER_COUNT];
+	
+	/* vsync'd presentation through the Present extension, and what it tells us about the display */
+	int use_present;
+	uint64_t vblank_ns; /* atomic, CLOCK_MONOTONIC time of the last frame going on screen, 0 if unknown */
+	uint64_t refresh_ns; /* atomic, measured refresh period, 0 if unknown */
+#ifdef ENABLE_PRESENT
+	int present_opcode;
+	uint32_t present_serial;
+	display_pixmap pixmaps[DISPLAY_PIXMAP_COUNT];
+	uint64_t last_ust;
+	uint64_t last_msc;
+	unsigned long presented;
+	unsigned long present_skipped; /* frames the server didn't get on screen */
+	unsigned long present_dropped; /* frames we had no idle pixmap for */
+	unsigned long latency_frames;
+	double latency_sum;
+	uint64_t latency_max;
+#endif
+} display;
+
+/*
+ * opens the display and creates a window for frames of up to the given size
+ * depth picks a TrueColor visual of that depth, 0 uses the screen's default if it's TrueColor
+ * framebuffers are scale times the frame size in each direction, 0 picks the largest scale that fits
+ * the screen in fullscreen and 1 otherwise
+ * framebuffers use the visual's pixel format, see bytes_per_pixel and the masks in vis_info
+ * shared memory images are used when the server supports them, otherwise XPutImage is used
+ * present asks for frames to be shown at vblank through the Present extension, if built in and supported
+ * returns true on success, otherwise false
+ */
+int display_init(display * d, int width, int height, int depth, int scale, int fullscreen, int present);
+
+/*
+ * gets the pixels of one of the DISPLAY_BUFFER_COUNT framebuffers
+ */
+void * display_get_framebuffer(display * d, int index);
+
+/*
+ * checks if the server is still reading from a framebuffer
+ * returns true if it is, in which case it must not be drawn into
+ */
+int display_is_busy(display * d, int index);
+
+/*
+ * checks if the window lost its contents, so the last frame has to be sent again
+ */
+int display_needs_redraw(display * d);
+
+/*
+ * sends the rows of a framebuffer whose hashes differ from those already on screen to the window
+ * width and height are the frame's size before scaling, frame_time is when it was finished (CLOCK_MONOTONIC)
+ */
+void display_present(display * d, int index, int width, int height, const uint32_t * line_hash, uint64_t frame_time);
+
+/*
+ * handles display-internal events such as shared memory completions
+ * returns true if the event was consumed, otherwise false
+ */
+int display_handle_event(display * d, XEvent * ev);
+
+/*
+ * prints what the Present extension reported about presentation timing
+ */
+void display_report(display * d);
+
+void display_shutdown(display * d);
+
+#endif /* DISPLAY_H */
@@ -7,22 +7,50 @@
 #include "emulator.h"
 #include "file.h"
 #include "path.h"
+#include "convert.h"
+#include "timing.h"
+#include "atomic.h"
+#include "trace.h"
+#include "profile.h"
+#include "savestate.h"
 
-const char save_state_magic[8] = "CMDEFSS";
-const size_t save_state_size = sizeof(save_state_magic) + sizeof(ClownMDEmu_StateBackup) + sizeof(CDReader_StateBackup) + sizeof(palette);
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
 
 /* TODO: deal with these */
 #define ROM_SIZE_MAX 0x800000
-#define SAMPLE_BUFFER_SIZE MIXER_MAXIMUM_AUDIO_FRAMES_PER_FRAME * MIXER_CHANNEL_COUNT * sizeof(cc_s16l)
+/* leaves room for the resampler stretching a frame of audio by up to 1/64 */
+#define SAMPLE_BUFFER_FRAMES (MIXER_MAXIMUM_AUDIO_FRAMES_PER_FRAME + MIXER_MAXIMUM_AUDIO_FRAMES_PER_FRAME / 64 + 1)
+#define SAMPLE_BUFFER_SIZE SAMPLE_BUFFER_FRAMES * MIXER_CHANNEL_COUNT * sizeof(cc_s16l)
 
-/* TODO: move this somewhere else */
-void warn(const char * fmt, ...)
+/* hash of a scanline that wasn't drawn, line hashes tell whether a scanline differs from the one already on screen */
+#define LINE_HASH_BLANK 0U
+
+/* room for a few frames' worth of scanlines, the worker is normally only a line or two behind */
+#define LINE_QUEUE_SIZE (128 * 1024)
+
+/* times the worker polls an empty queue before going to sleep, lines come a lot quicker than a wakeup does */
+#define LINE_WORKER_SPIN 20000
+
+/* what the scanline callback sends the conversion worker in pipelined mode */
+#define LINE_RECORD_LINE 0 /* followed by right - left indices */
+#define LINE_RECORD_PALETTE 1 /* followed by a palette */
+#define LINE_RECORD_FLUSH 2 /* end of the frame, post lines_done */
+#define LINE_RECORD_QUIT 3
+
+typedef struct line_record
+{
+	unsigned int kind;
+	cc_u16l scanline;
+	cc_u16l left;
+	cc_u16l right;
+	cc_u16l width;
+} line_record;
+
+static void emulator_hash_frame(emulator * e, uint32_t value)
 {
-	va_list args;
-	va_start(args, fmt);
-	printf("WARN: ");
-	vprintf(fmt, args);
-	va_end(args);
+	e->frame_hash = (e->frame_hash ^ value) * CONVERT_HASH_PRIME;
 }
 
 /* callbacks */
@@ -30,29 +58,163 @@ void warn(const char * fmt, ...)
 static void emulator_callback_color_update(void * data, cc_u16f idx, cc_u16f color)
 {
 	emulator * e = (emulator *) data;
-	const cc_u32f r = color & 0xF;
-	const cc_u32f g = color >> 4 & 0xF;
-	const cc_u32f b = color >> 8 & 0xF;
+	e->colors[idx] = convert_lut_argb[color & (CONVERT_COLOR_COUNT - 1)];
+	e->out_colors[idx] = convert_lut[color & (CONVERT_COLOR_COUNT - 1)];
+	e->palette_dirty = cc_true;
+}
+
+/* makes sure the newest palette snapshot matches the current palette */
+static void emulator_snapshot_palette(emulator * e)
+{
+	if (e->palette_count > 0 && !e->palette_dirty)
+	{
+		return;
+	}
+	/* there's room for one snapshot per scanline, and never more than one is taken per scanline */
+	memcpy(e->line_palettes[e->palette_count++], e->out_colors, sizeof(palette));
+	e->palette_dirty = cc_false;
+	emulator_hash_frame(e, convert_hash(e->out_colors, sizeof(palette)));
+}
+
+/*
+ * converts a scanline into the first row of its group of scale rows in dst, returning the line's hash
+ * scaled lines are converted into a scratch row first, so the expansion reads from cache
+ */
+static uint32_t emulator_draw_line(emulator * e, void * dst, int y, unsigned int width, const cc_u8l * indices, const uint32_t * colors, unsigned int left, unsigned int right)
+{
+	unsigned char * line = (unsigned char *) dst + ((size_t) y * e->scale * width * e->scale + left * e->scale) * convert_pixel_bytes;
+	uint32_t hash;
+	uint64_t start;
+	if (e->scale == 1)
+	{
+		hash = convert_line(line, indices, colors, right - left);
+	}
+	else
+	{
+		hash = convert_line(e->scale_row, indices, colors, right - left);
+		start = timing_now();
+		convert_scale_line(line, e->scale_row, right - left, e->scale);
+		e->scale_ns += timing_now() - start;
+	}
+	return (hash ^ left ^ (right << 16)) * CONVERT_HASH_PRIME;
+}
+
+/* waits for space, so records are only ever seen whole by the worker */
+static void emulator_queue_line(emulator * e, unsigned int kind, unsigned int scanline, unsigned int width, unsigned int left, unsigned int right, const void * data, size_t bytes)
+{
+	unsigned char buf[sizeof(line_record) + VDP_MAX_SCANLINE_WIDTH * sizeof(cc_u8l) + sizeof(palette)];
+	line_record rec;
+	rec.kind = kind;
+	rec.scanline = scanline;
+	rec.width = width;
+	rec.left = left;
+	rec.right = right;
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), data, bytes);
+	while (ring_buffer_space(&e->line_queue) < sizeof(rec) + bytes)
+	{
+		/* a whole queue behind, which only happens if the worker isn't getting any cpu time */
+		sched_yield();
+	}
+	ring_buffer_write(&e->line_queue, buf, sizeof(rec) + bytes);
+	
+	/* only pay for a wakeup if the worker gave up polling, the fence pairs with the one in the worker */
+	atomic_fence();
+	if (atomic_get(&e->worker_asleep) && atomic_swap(&e->worker_asleep, 0))
+	{
+		sem_post(&e->lines_queued);
+	}
+}
+
+static void * emulator_line_worker(void * arg)
+{
+	emulator * e = (emulator *) arg;
+	line_record rec;
+	cc_u8l indices[VDP_MAX_SCANLINE_WIDTH];
+	unsigned int spin;
 	
-	/* in ARGB8888 format */
-	e->colors[idx] = 0xFF000000 | (r << 20) | (r << 16) | (g << 12) | (g << 8) | (b << 4) | b;
+	trace_thread_name("line worker");
+	for (;;)
+	{
+		/* records are written whole, so any bytes at all means a complete one */
+		for (spin = 0; ring_buffer_used(&e->line_queue) == 0 && spin < LINE_WORKER_SPIN; spin++)
+		{
+		}
+		if (ring_buffer_used(&e->line_queue) == 0)
+		{
+			atomic_set(&e->worker_asleep, 1);
+			atomic_fence();
+			if (ring_buffer_used(&e->line_queue) == 0)
+			{
+				while (sem_wait(&e->lines_queued) != 0 && errno == EINTR)
+				{
+				}
+			}
+			/* a post may still be on its way if the producer saw us going to sleep, which only costs a spurious wakeup */
+			atomic_set(&e->worker_asleep, 0);
+			continue;
+		}
+		ring_buffer_read(&e->line_queue, &rec, sizeof(rec));
+		switch (rec.kind)
+		{
+			case LINE_RECORD_LINE:
+				ring_buffer_read(&e->line_queue, indices, (rec.right - rec.left) * sizeof(cc_u8l));
+				e->line_hash[rec.scanline] = emulator_draw_line(e, e->framebuffer, rec.scanline, rec.width, indices, e->worker_colors, rec.left, rec.right);
+				break;
+			case LINE_RECORD_PALETTE:
+				ring_buffer_read(&e->line_queue, e->worker_colors, sizeof(palette));
+				break;
+			case LINE_RECORD_FLUSH:
+				sem_post(&e->lines_done);
+				break;
+			case LINE_RECORD_QUIT:
+				return NULL;
+		}
+	}
 }
 
 static void emulator_callback_scanline_render(void * data, cc_u16f scanline, const cc_u8l * pixels, cc_u16f left_boundary, cc_u16f right_boundary, cc_u16f width, cc_u16f height)
 {
 	emulator * e = (emulator *) data;
-	cc_u16f i;
-	const cc_u8l * input;
-	uint32_t * output;
+	uint64_t start;
+	if (!e->render_enabled)
+	{
+		return;
+	}
 	e->width = width;
 	e->height = height;
-	input = pixels + left_boundary;
-	output = &e->framebuffer[scanline * width + left_boundary];
-	
-	for (i = left_boundary; i < right_boundary; ++i)
+	e->line_drawn[scanline] = cc_true;
+	e->line_left[scanline] = left_boundary;
+	e->line_right[scanline] = right_boundary;
+	emulator_hash_frame(e, scanline | left_boundary << 9 | right_boundary << 20);
+	if (e->indexed)
+	{
+		/* the indices are hashed rather than the pixels, so a repeated frame can be spotted without converting it */
+		emulator_snapshot_palette(e);
+		e->line_palette[scanline] = (cc_u16l) (e->palette_count - 1);
+		memcpy(&e->indices[scanline * width + left_boundary], pixels + left_boundary, (right_boundary - left_boundary) * sizeof(cc_u8l));
+		emulator_hash_frame(e, convert_hash(pixels + left_boundary, (right_boundary - left_boundary) * sizeof(cc_u8l)));
+		return;
+	}
+	if (e->pipelined)
 	{
-		*output++ = e->colors[*input++];
+		if (e->palette_dirty)
+		{
+			emulator_queue_line(e, LINE_RECORD_PALETTE, 0, 0, 0, 0, e->out_colors, sizeof(palette));
+			emulator_hash_frame(e, convert_hash(e->out_colors, sizeof(palette)));
+			e->palette_dirty = cc_false;
+		}
+		emulator_queue_line(e, LINE_RECORD_LINE, scanline, width, left_boundary, right_boundary, pixels + left_boundary, (right_boundary - left_boundary) * sizeof(cc_u8l));
+		emulator_hash_frame(e, convert_hash(pixels + left_boundary, (right_boundary - left_boundary) * sizeof(cc_u8l)));
+		return;
+	}
+	start = e->timed ? timing_now() : 0;
+	e->line_hash[scanline] = emulator_draw_line(e, e->framebuffer, scanline, width, pixels + left_boundary, e->out_colors, left_boundary, right_boundary);
+	if (e->timed)
+	{
+		e->convert_ns += timing_now() - start;
 	}
+	emulator_hash_frame(e, e->line_hash[scanline]);
 }
 
 static cc_bool emulator_callback_input_request(void * data, cc_u8f player, ClownMDEmu_Button button)
@@ -61,46 +223,86 @@ static cc_bool emulator_callback_input_request(void * data, cc_u8f player, Clown
 	return e->buttons[player][button];
 }
 
+/*
+ * the chips' state only advances as their audio is generated, so audio has to be
+ * generated even when it isn't going to be heard
+ */
+static void emulator_discard_audio(emulator * e, struct ClownMDEmu * clownmdemu, size_t frames, void (* generate_audio)(struct ClownMDEmu * clownmdemu, cc_s16l * sample_buffer, size_t total_frames))
+{
+	size_t chunk;
+	while (frames > 0)
+	{
+		chunk = frames < DISCARD_AUDIO_FRAMES ? frames : DISCARD_AUDIO_FRAMES;
+		generate_audio(clownmdemu, e->discard_samples, chunk);
+		frames -= chunk;
+	}
+}
+
 static void emulator_callback_fm_generate(void * data, struct ClownMDEmu * clownmdemu, size_t frames, void (* generate_fm_audio)(struct ClownMDEmu * clownmdemu, cc_s16l * sample_buffer, size_t total_frames))
 {
 	emulator * e = (emulator *) data;
+	if (!e->mix_enabled)
+	{
+		emulator_discard_audio(e, clownmdemu, frames, generate_fm_audio);
+		return;
+	}
 	generate_fm_audio(clownmdemu, Mixer_AllocateFMSamples(&e->mixer, frames), frames);
 }
 
 static void emulator_callback_psg_generate(void * data, struct ClownMDEmu * clownmdemu, size_t frames, void (* generate_psg_audio)(struct ClownMDEmu * clownmdemu, cc_s16l * sample_buffer, size_t total_samples))
 {
 	emulator * e = (emulator *) data;
+	if (!e->mix_enabled)
+	{
+		emulator_discard_audio(e, clownmdemu, frames, generate_psg_audio);
+		return;
+	}
 	generate_psg_audio(clownmdemu, Mixer_AllocatePSGSamples(&e->mixer, frames), frames);
 }
 
 static void emulator_callback_pcm_generate(void * data, struct ClownMDEmu * clownmdemu, size_t frames, void (* generate_pcm_audio)(struct ClownMDEmu * clownmdemu, cc_s16l * sample_buffer, size_t total_frames))
 {
 	emulator * e = (emulator *) data;
+	if (!e->mix_enabled)
+	{
+		emulator_discard_audio(e, clownmdemu, frames, generate_pcm_audio);
+		return;
+	}
 	generate_pcm_audio(clownmdemu, Mixer_AllocatePCMSamples(&e->mixer, frames), frames);
 }
 
 static void emulator_callback_cdda_generate(void * data, struct ClownMDEmu * clownmdemu, size_t frames, void (* generate_cdda_audio)(struct ClownMDEmu * clownmdemu, cc_s16l * sample_buffer, size_t total_frames))
 {
 	emulator * e = (emulator *) data;
+	if (!e->mix_enabled)
+	{
+		emulator_discard_audio(e, clownmdemu, frames, generate_cdda_audio);
+		return;
+	}
 	generate_cdda_audio(clownmdemu, Mixer_AllocateCDDASamples(&e->mixer, frames), frames);
 }
 
 static void emulator_callback_cd_seek(void * data, cc_u32f idx)
 {
 	emulator * e = (emulator *) data;
+	TRACE_BEGIN("cd_seek");
 	CDReader_SeekToSector(&e->cd, idx);
+	TRACE_END("cd_seek");
 }
 
 static void emulator_callback_cd_sector_read(void * data, cc_u16l * buf)
 {
 	emulator * e = (emulator *) data;
+	TRACE_BEGIN("cd_sector_read");
 	CDReader_ReadSector(&e->cd, buf);
+	TRACE_END("cd_sector_read");
 }
 
 static cc_bool emulator_callback_cd_seek_track(void * data, cc_u16f idx, ClownMDEmu_CDDAMode mode)
 {
 	emulator * e = (emulator *) data;
 	CDReader_PlaybackSetting playback_setting;
+	cc_bool playing;
 	
 	switch (mode)
 	{
@@ -118,25 +320,41 @@ static cc_bool emulator_callback_cd_seek_track(void * data, cc_u16f idx, ClownMD
 			return cc_false;
 	}
 	
-	return CDReader_PlayAudio(&e->cd, idx, playback_setting);
+	TRACE_BEGIN("cd_track_seek");
+	playing = CDReader_PlayAudio(&e->cd, idx, playback_setting);
+	TRACE_END("cd_track_seek");
+	return playing;
 }
 
 static size_t emulator_callback_cd_audio_read(void * data, cc_s16l * buf, size_t frames)
 {
 	emulator * e = (emulator *) data;
-	return CDReader_ReadAudio(&e->cd, buf, frames);
+	size_t read;
+	TRACE_BEGIN("cd_audio_read");
+	read = CDReader_ReadAudio(&e->cd, buf, frames);
+	TRACE_END("cd_audio_read");
+	return read;
 }
 
+/* save files are traced from being opened to being closed, rather than a byte at a time */
 static cc_bool emulator_callback_save_file_open_read(void * data, const char * filename)
 {
 	emulator * e = (emulator *) data;
-	char * file_path = build_file_path(get_exe_dir(), filename);
+	char * file_path;
+	TRACE_BEGIN("save_file_read");
+	file_path = build_file_path(get_exe_dir(), filename);
 	if (!file_path)
 	{
+		TRACE_END("save_file_read");
 		return cc_false;
 	}
 	e->bram = file_open_read(file_path);
 	free(file_path);
+	if (!e->bram)
+	{
+		TRACE_END("save_file_read");
+	}
+	e->bram_span = "save_file_read";
 	return e->bram ? cc_true : cc_false;
 }
 
@@ -157,13 +375,21 @@ static cc_s16f emulator_callback_save_file_read(void * data)
 static cc_bool emulator_callback_save_file_open_write(void * data, const char * filename)
 {
 	emulator * e = (emulator *) data;
-	char * file_path = build_file_path(get_exe_dir(), filename);
+	char * file_path;
+	TRACE_BEGIN("save_file_write");
+	file_path = build_file_path(get_exe_dir(), filename);
 	if (!file_path)
 	{
+		TRACE_END("save_file_write");
 		return cc_false;
 	}
 	e->bram = file_open_truncate(file_path);
 	free(file_path);
+	if (!e->bram)
+	{
+		TRACE_END("save_file_write");
+	}
+	e->bram_span = "save_file_write";
 	return e->bram ? cc_true : cc_false;
 }
 
@@ -182,6 +408,8 @@ static void emulator_callback_save_file_close(void * data)
 	if (e->bram)
 	{
 		file_close(e->bram);
+		e->bram = NULL;
+		TRACE_END(e->bram_span);
 	}
 }
 
@@ -194,7 +422,9 @@ static cc_bool emulator_callback_save_file_remove(void * data, const char * file
 	{
 		return cc_false;
 	}
+	TRACE_BEGIN("save_file_remove");
 	status = remove(file_path);
+	TRACE_END("save_file_remove");
 	free(file_path);
 	return status == 0 ? cc_true : cc_false;
 }
@@ -208,6 +438,7 @@ static cc_bool emulator_callback_save_file_size_obtain(void * data, const char *
 	{
 		return cc_false;
 	}
+	TRACE_BEGIN("save_file_size");
 	e->bram = file_open_read(file_path);
 	free(file_path);
 	if (e->bram)
@@ -221,17 +452,16 @@ static cc_bool emulator_callback_save_file_size_obtain(void * data, const char *
 			*size = file_size;
 		}
 	}
+	TRACE_END("save_file_size");
 	return file_size > 0 ? cc_true : cc_false;
 }
 
 static void emulator_callback_log(void * data, const char * fmt, va_list args)
 {
 	emulator * e = (emulator *) data;
-	if (e->log_enabled == cc_true)
+	if (e->log_enabled == cc_true && !e->speculating)
 	{
-		printf("core: ");
-		vprintf(fmt, args);
-		printf("\n");
+		logger_write(LOGGER_CORE, fmt, args);
 	}
 }
 
@@ -307,7 +537,7 @@ static void emulator_callback_clowncd_log(void * data, const char * msg)
 	emulator * e = (emulator *) data;
 	if (e->log_enabled == cc_true)
 	{
-		printf("clowncd: %s\n", msg);
+		logger_printf(LOGGER_CLOWNCD, "%s", msg);
 	}
 }
 
@@ -315,44 +545,288 @@ static void emulator_callback_mixer_complete(void * data, const cc_s16l * sample
 {
 	emulator * e = (emulator *) data;
 	size_t bytes = frames * sizeof(cc_s16l) * MIXER_CHANNEL_COUNT;
+	size_t out_frames;
+	size_t i;
+	unsigned int c;
+	double step;
+	double pos;
+	double frac;
+	const cc_s16l * a;
+	const cc_s16l * b;
+	cc_s16l * output;
 	if (frames == 0 || frames > MIXER_MAXIMUM_AUDIO_FRAMES_PER_FRAME)
 	{
 		return;
 	}
-	memcpy(e->samples, samples, bytes);
-	e->audio_bytes = bytes;
+	if (e->resample_ratio == 1.0)
+	{
+		memcpy(e->samples, samples, bytes);
+		memcpy(e->resample_last, &samples[(frames - 1) * MIXER_CHANNEL_COUNT], sizeof(e->resample_last));
+		e->audio_bytes = bytes;
+		return;
+	}
+	
+	/*
+	 * linear interpolation, where position 0 is the last frame of the previous call
+	 * and position n is samples[n - 1], so there are no seams between calls
+	 */
+	step = 1.0 / e->resample_ratio;
+	pos = e->resample_pos;
+	output = e->samples;
+	out_frames = 0;
+	while (pos < frames && out_frames < SAMPLE_BUFFER_FRAMES)
+	{
+		i = (size_t) pos;
+		frac = pos - i;
+		a = i == 0 ? e->resample_last : &samples[(i - 1) * MIXER_CHANNEL_COUNT];
+		b = &samples[i * MIXER_CHANNEL_COUNT];
+		for (c = 0; c < MIXER_CHANNEL_COUNT; c++)
+		{
+			*output++ = (cc_s16l) (a[c] + (b[c] - a[c]) * frac);
+		}
+		out_frames++;
+		pos += step;
+	}
+	e->resample_pos = pos - frames;
+	memcpy(e->resample_last, &samples[(frames - 1) * MIXER_CHANNEL_COUNT], sizeof(e->resample_last));
+	e->audio_bytes = out_frames * sizeof(cc_s16l) * MIXER_CHANNEL_COUNT;
+}
+
+#ifdef PROFILE_CALLBACKS
+/* profiling wrappers, which time each callback and count its calls */
+
+static void emulator_profiled_scanline_render(void * data, cc_u16f scanline, const cc_u8l * pixels, cc_u16f left_boundary, cc_u16f right_boundary, cc_u16f width, cc_u16f height)
+{
+	uint64_t start = profile_begin();
+	emulator_callback_scanline_render(data, scanline, pixels, left_boundary, right_boundary, width, height);
+	profile_end(PROFILE_SCANLINE_RENDERED, start);
+}
+
+static void emulator_profiled_color_update(void * data, cc_u16f idx, cc_u16f color)
+{
+	uint64_t start = profile_begin();
+	emulator_callback_color_update(data, idx, color);
+	profile_end(PROFILE_COLOUR_UPDATED, start);
+}
+
+static cc_bool emulator_profiled_input_request(void * data, cc_u8f player, ClownMDEmu_Button button)
+{
+	uint64_t start = profile_begin();
+	cc_bool result;
+	result = emulator_callback_input_request(data, player, button);
+	profile_end(PROFILE_INPUT_REQUESTED, start);
+	return result;
+}
+
+static void emulator_profiled_fm_generate(void * data, struct ClownMDEmu * clownmdemu, size_t frames, void (* generate_fm_audio)(struct ClownMDEmu * clownmdemu, cc_s16l * sample_buffer, size_t total_frames))
+{
+	uint64_t start = profile_begin();
+	emulator_callback_fm_generate(data, clownmdemu, frames, generate_fm_audio);
+	profile_end(PROFILE_FM_AUDIO, start);
+}
+
+static void emulator_profiled_psg_generate(void * data, struct ClownMDEmu * clownmdemu, size_t frames, void (* generate_psg_audio)(struct ClownMDEmu * clownmdemu, cc_s16l * sample_buffer, size_t total_samples))
+{
+	uint64_t start = profile_begin();
+	emulator_callback_psg_generate(data, clownmdemu, frames, generate_psg_audio);
+	profile_end(PROFILE_PSG_AUDIO, start);
+}
+
+static void emulator_profiled_pcm_generate(void * data, struct ClownMDEmu * clownmdemu, size_t frames, void (* generate_pcm_audio)(struct ClownMDEmu * clownmdemu, cc_s16l * sample_buffer, size_t total_frames))
+{
+	uint64_t start = profile_begin();
+	emulator_callback_pcm_generate(data, clownmdemu, frames, generate_pcm_audio);
+	profile_end(PROFILE_PCM_AUDIO, start);
+}
+
+static void emulator_profiled_cdda_generate(void * data, struct ClownMDEmu * clownmdemu, size_t frames, void (* generate_cdda_audio)(struct ClownMDEmu * clownmdemu, cc_s16l * sample_buffer, size_t total_frames))
+{
+	uint64_t start = profile_begin();
+	emulator_callback_cdda_generate(data, clownmdemu, frames, generate_cdda_audio);
+	profile_end(PROFILE_CDDA_AUDIO, start);
+}
+
+static void emulator_profiled_cd_seek(void * data, cc_u32f idx)
+{
+	uint64_t start = profile_begin();
+	emulator_callback_cd_seek(data, idx);
+	profile_end(PROFILE_CD_SEEKED, start);
+}
+
+static void emulator_profiled_cd_sector_read(void * data, cc_u16l * buf)
+{
+	uint64_t start = profile_begin();
+	emulator_callback_cd_sector_read(data, buf);
+	profile_end(PROFILE_CD_SECTOR_READ, start);
+}
+
+static cc_bool emulator_profiled_cd_seek_track(void * data, cc_u16f idx, ClownMDEmu_CDDAMode mode)
+{
+	uint64_t start = profile_begin();
+	cc_bool result;
+	result = emulator_callback_cd_seek_track(data, idx, mode);
+	profile_end(PROFILE_CD_TRACK_SEEKED, start);
+	return result;
+}
+
+static size_t emulator_profiled_cd_audio_read(void * data, cc_s16l * buf, size_t frames)
+{
+	uint64_t start = profile_begin();
+	size_t result;
+	result = emulator_callback_cd_audio_read(data, buf, frames);
+	profile_end(PROFILE_CD_AUDIO_READ, start);
+	return result;
+}
+
+static cc_bool emulator_profiled_save_file_open_read(void * data, const char * filename)
+{
+	uint64_t start = profile_begin();
+	cc_bool result;
+	result = emulator_callback_save_file_open_read(data, filename);
+	profile_end(PROFILE_SAVE_FILE_OPENED_FOR_READING, start);
+	return result;
+}
+
+static cc_s16f emulator_profiled_save_file_read(void * data)
+{
+	uint64_t start = profile_begin();
+	cc_s16f result;
+	result = emulator_callback_save_file_read(data);
+	profile_end(PROFILE_SAVE_FILE_READ, start);
+	return result;
+}
+
+static cc_bool emulator_profiled_save_file_open_write(void * data, const char * filename)
+{
+	uint64_t start = profile_begin();
+	cc_bool result;
+	result = emulator_callback_save_file_open_write(data, filename);
+	profile_end(PROFILE_SAVE_FILE_OPENED_FOR_WRITING, start);
+	return result;
+}
+
+static void emulator_profiled_save_file_write(void * data, cc_u8f val)
+{
+	uint64_t start = profile_begin();
+	emulator_callback_save_file_write(data, val);
+	profile_end(PROFILE_SAVE_FILE_WRITTEN, start);
+}
+
+static void emulator_profiled_save_file_close(void * data)
+{
+	uint64_t start = profile_begin();
+	emulator_callback_save_file_close(data);
+	profile_end(PROFILE_SAVE_FILE_CLOSED, start);
+}
+
+static cc_bool emulator_profiled_save_file_remove(void * data, const char * filename)
+{
+	uint64_t start = profile_begin();
+	cc_bool result;
+	result = emulator_callback_save_file_remove(data, filename);
+	profile_end(PROFILE_SAVE_FILE_REMOVED, start);
+	return result;
+}
+
+static cc_bool emulator_profiled_save_file_size_obtain(void * data, const char * filename, size_t * size)
+{
+	uint64_t start = profile_begin();
+	cc_bool result;
+	result = emulator_callback_save_file_size_obtain(data, filename, size);
+	profile_end(PROFILE_SAVE_FILE_SIZE_OBTAINED, start);
+	return result;
+}
+
+static void * emulator_profiled_clowncd_open(const char * filename, ClownCD_FileMode mode)
+{
+	uint64_t start = profile_begin();
+	void * result;
+	result = emulator_callback_clowncd_open(filename, mode);
+	profile_end(PROFILE_CLOWNCD_OPEN, start);
+	return result;
+}
+
+static int emulator_profiled_clowncd_close(void * stream)
+{
+	uint64_t start = profile_begin();
+	int result;
+	result = emulator_callback_clowncd_close(stream);
+	profile_end(PROFILE_CLOWNCD_CLOSE, start);
+	return result;
+}
+
+static size_t emulator_profiled_clowncd_read(void * buf, size_t size, size_t count, void * stream)
+{
+	uint64_t start = profile_begin();
+	size_t result;
+	result = emulator_callback_clowncd_read(buf, size, count, stream);
+	profile_end(PROFILE_CLOWNCD_READ, start);
+	return result;
+}
+
+static size_t emulator_profiled_clowncd_write(const void * buf, size_t size, size_t count, void * stream)
+{
+	uint64_t start = profile_begin();
+	size_t result;
+	result = emulator_callback_clowncd_write(buf, size, count, stream);
+	profile_end(PROFILE_CLOWNCD_WRITE, start);
+	return result;
+}
+
+static long emulator_profiled_clowncd_tell(void * stream)
+{
+	uint64_t start = profile_begin();
+	long result;
+	result = emulator_callback_clowncd_tell(stream);
+	profile_end(PROFILE_CLOWNCD_TELL, start);
+	return result;
+}
+
+static int emulator_profiled_clowncd_seek(void * stream, long pos, ClownCD_FileOrigin origin)
+{
+	uint64_t start = profile_begin();
+	int result;
+	result = emulator_callback_clowncd_seek(stream, pos, origin);
+	profile_end(PROFILE_CLOWNCD_SEEK, start);
+	return result;
 }
 
+#define EMULATOR_CALLBACK(name) emulator_profiled_##name
+#else
+#define EMULATOR_CALLBACK(name) emulator_callback_##name
+#endif
+
 /* utility functions */
 
 void emulator_init(emulator * emu)
 {
+	emu->scale = 1;
 	emu->callbacks.user_data = emu;
-	emu->callbacks.colour_updated = emulator_callback_color_update;
-	emu->callbacks.scanline_rendered = emulator_callback_scanline_render;
-	emu->callbacks.input_requested = emulator_callback_input_request;
-	emu->callbacks.fm_audio_to_be_generated = emulator_callback_fm_generate;
-	emu->callbacks.psg_audio_to_be_generated = emulator_callback_psg_generate;
-	emu->callbacks.pcm_audio_to_be_generated = emulator_callback_pcm_generate;
-	emu->callbacks.cdda_audio_to_be_generated = emulator_callback_cdda_generate;
-	emu->callbacks.cd_seeked = emulator_callback_cd_seek;
-	emu->callbacks.cd_sector_read = emulator_callback_cd_sector_read;
-	emu->callbacks.cd_track_seeked = emulator_callback_cd_seek_track;
-	emu->callbacks.cd_audio_read = emulator_callback_cd_audio_read;
-	emu->callbacks.save_file_opened_for_reading = emulator_callback_save_file_open_read;
-	emu->callbacks.save_file_read = emulator_callback_save_file_read;
-	emu->callbacks.save_file_opened_for_writing = emulator_callback_save_file_open_write;
-	emu->callbacks.save_file_written = emulator_callback_save_file_write;
-	emu->callbacks.save_file_closed = emulator_callback_save_file_close;
-	emu->callbacks.save_file_removed = emulator_callback_save_file_remove;
-	emu->callbacks.save_file_size_obtained = emulator_callback_save_file_size_obtain;
+	emu->callbacks.colour_updated = EMULATOR_CALLBACK(color_update);
+	emu->callbacks.scanline_rendered = EMULATOR_CALLBACK(scanline_render);
+	emu->callbacks.input_requested = EMULATOR_CALLBACK(input_request);
+	emu->callbacks.fm_audio_to_be_generated = EMULATOR_CALLBACK(fm_generate);
+	emu->callbacks.psg_audio_to_be_generated = EMULATOR_CALLBACK(psg_generate);
+	emu->callbacks.pcm_audio_to_be_generated = EMULATOR_CALLBACK(pcm_generate);
+	emu->callbacks.cdda_audio_to_be_generated = EMULATOR_CALLBACK(cdda_generate);
+	emu->callbacks.cd_seeked = EMULATOR_CALLBACK(cd_seek);
+	emu->callbacks.cd_sector_read = EMULATOR_CALLBACK(cd_sector_read);
+	emu->callbacks.cd_track_seeked = EMULATOR_CALLBACK(cd_seek_track);
+	emu->callbacks.cd_audio_read = EMULATOR_CALLBACK(cd_audio_read);
+	emu->callbacks.save_file_opened_for_reading = EMULATOR_CALLBACK(save_file_open_read);
+	emu->callbacks.save_file_read = EMULATOR_CALLBACK(save_file_read);
+	emu->callbacks.save_file_opened_for_writing = EMULATOR_CALLBACK(save_file_open_write);
+	emu->callbacks.save_file_written = EMULATOR_CALLBACK(save_file_write);
+	emu->callbacks.save_file_closed = EMULATOR_CALLBACK(save_file_close);
+	emu->callbacks.save_file_removed = EMULATOR_CALLBACK(save_file_remove);
+	emu->callbacks.save_file_size_obtained = EMULATOR_CALLBACK(save_file_size_obtain);
 	
-	emu->cd_callbacks.open = emulator_callback_clowncd_open;
-	emu->cd_callbacks.close = emulator_callback_clowncd_close;
-	emu->cd_callbacks.read = emulator_callback_clowncd_read;
-	emu->cd_callbacks.write = emulator_callback_clowncd_write;
-	emu->cd_callbacks.tell = emulator_callback_clowncd_tell;
-	emu->cd_callbacks.seek = emulator_callback_clowncd_seek;
+	emu->cd_callbacks.open = EMULATOR_CALLBACK(clowncd_open);
+	emu->cd_callbacks.close = EMULATOR_CALLBACK(clowncd_close);
+	emu->cd_callbacks.read = EMULATOR_CALLBACK(clowncd_read);
+	emu->cd_callbacks.write = EMULATOR_CALLBACK(clowncd_write);
+	emu->cd_callbacks.tell = EMULATOR_CALLBACK(clowncd_tell);
+	emu->cd_callbacks.seek = EMULATOR_CALLBACK(clowncd_seek);
 	
 	ClownCD_SetErrorCallback(emulator_callback_clowncd_log, emu);
 	ClownMDEmu_SetLogCallback(emulator_callback_log, emu);
@@ -365,6 +839,8 @@ void emulator_init(emulator * emu)
 void emulator_init_audio(emulator * emu)
 {
 	cc_bool pal = emu->clownmdemu.configuration.tv_standard == CLOWNMDEMU_TV_STANDARD_PAL ? cc_true : cc_false;
+	emu->resample_ratio = 1.0;
+	emu->resample_pos = 0.0;
 	emu->samples = (cc_s16l *) malloc(SAMPLE_BUFFER_SIZE);
 	if (!emu->samples)
 	{
@@ -467,6 +943,98 @@ void emulator_set_options(emulator * emu, cc_bool log_enabled, cc_bool widescree
 	emu->clownmdemu.vdp.configuration.widescreen_tiles = widescreen_enabled == cc_true ? VDP_MAX_WIDESCREEN_TILES : 0;
 }
 
+void emulator_set_runahead(emulator * emu, unsigned int frames)
+{
+	emu->runahead = frames;
+}
+
+/*
+ * switches between rendering pixels into emu->framebuffer and keeping palette indices,
+ * which take a quarter of the memory and are converted by emulator_convert_frame()
+ * returns true on success, otherwise false
+ */
+int emulator_set_indexed(emulator * emu, cc_bool indexed)
+{
+	if (indexed && !emu->indices)
+	{
+		emu->indices = (cc_u8l *) malloc(VDP_MAX_SCANLINE_WIDTH * VDP_MAX_SCANLINES * sizeof(cc_u8l));
+		/* enough for a new palette on every scanline, so the scanline callback never has to grow it, or fail */
+		emu->line_palettes = (palette *) malloc(VDP_MAX_SCANLINES * sizeof(palette));
+		if (!emu->indices || !emu->line_palettes)
+		{
+			printf("emulator_set_indexed: unable to alloc indexed framebuffer\n");
+			free(emu->indices);
+			free(emu->line_palettes);
+			emu->indices = NULL;
+			emu->line_palettes = NULL;
+			return 0;
+		}
+	}
+	emu->indexed = indexed;
+	return 1;
+}
+
+/*
+ * makes frames come out scale times their size in each direction
+ * returns true on success, otherwise false
+ */
+int emulator_set_scale(emulator * emu, unsigned int scale)
+{
+	if (scale > 1 && !emu->scale_row)
+	{
+		emu->scale_row = malloc(VDP_MAX_SCANLINE_WIDTH * sizeof(uint32_t));
+		if (!emu->scale_row)
+		{
+			printf("emulator_set_scale: unable to alloc scaling buffer\n");
+			return 0;
+		}
+	}
+	emu->scale = scale > 0 ? scale : 1;
+	return 1;
+}
+
+/*
+ * starts or stops the scanline conversion worker, which takes palette expansion off the emulation thread
+ * has no effect in indexed mode, which doesn't convert while emulating
+ * returns true on success, otherwise false
+ */
+int emulator_set_pipelined(emulator * emu, cc_bool pipelined)
+{
+	if (pipelined && !emu->pipelined)
+	{
+		if (!ring_buffer_init(&emu->line_queue, LINE_QUEUE_SIZE))
+		{
+			printf("emulator_set_pipelined: unable to alloc line queue\n");
+			return 0;
+		}
+		if (sysconf(_SC_NPROCESSORS_ONLN) == 1)
+		{
+			warn("only one cpu online, scanline conversion can't overlap emulation\n");
+		}
+		emu->worker_asleep = 0;
+		sem_init(&emu->lines_queued, 0, 0);
+		sem_init(&emu->lines_done, 0, 0);
+		if (pthread_create(&emu->line_worker, NULL, emulator_line_worker, emu) != 0)
+		{
+			printf("emulator_set_pipelined: unable to start conversion worker\n");
+			sem_destroy(&emu->lines_done);
+			sem_destroy(&emu->lines_queued);
+			ring_buffer_free(&emu->line_queue);
+			return 0;
+		}
+	}
+	else if (!pipelined && emu->pipelined)
+	{
+		emulator_queue_line(emu, LINE_RECORD_QUIT, 0, 0, 0, 0, NULL, 0);
+		pthread_join(emu->line_worker, NULL);
+		sem_destroy(&emu->lines_done);
+		sem_destroy(&emu->lines_queued);
+		ring_buffer_free(&emu->line_queue);
+	}
+	emu->pipelined = pipelined;
+	return 1;
+}
+
 void emulator_reset(emulator * emu, cc_bool hard)
 {
 	if (hard)
@@ -487,16 +1055,168 @@ void emulator_reset(emulator * emu, cc_bool hard)
 	);*/
 }
 
-void emulator_iterate(emulator * emu)
+static void emulator_run_frame(emulator * emu, cc_bool render, cc_bool mix)
 {
-	if (emu->audio_init)
+	uint64_t start;
+	uint64_t end;
+	uint64_t converted;
+	emu->render_enabled = render;
+	emu->mix_enabled = mix && emu->audio_init ? cc_true : cc_false;
+	if (render)
+	{
+		memset(emu->line_drawn, 0, sizeof(emu->line_drawn));
+		emu->palette_count = 0;
+		emu->frame_hash = CONVERT_HASH_BASIS;
+		/* the frame hash has to cover the palette the frame starts with */
+		emu->palette_dirty = cc_true;
+	}
+	if (emu->mix_enabled)
 	{
 		Mixer_Begin(&emu->mixer);
 	}
-	ClownMDEmu_Iterate(&emu->clownmdemu);
-	if (emu->audio_init)
+	if (emu->timed)
+	{
+		/* conversion done by the scanline callback is counted separately, so take it back out of the core's time */
+		converted = emu->convert_ns;
+		start = timing_now();
+		ClownMDEmu_Iterate(&emu->clownmdemu);
+		emu->core_ns += timing_now() - start - (emu->convert_ns - converted);
+	}
+	else
+	{
+		ClownMDEmu_Iterate(&emu->clownmdemu);
+	}
+	if (render)
 	{
+		emulator_hash_frame(emu, emu->width | emu->height << 16);
+	}
+	if (render && emu->pipelined && !emu->indexed)
+	{
+		/* the frame isn't finished until the worker has converted every line of it */
+		start = timing_now();
+		emulator_queue_line(emu, LINE_RECORD_FLUSH, 0, 0, 0, 0, NULL, 0);
+		while (sem_wait(&emu->lines_done) != 0 && errno == EINTR)
+		{
+		}
+		end = timing_now();
+		emu->pipeline_wait_ns += end - start;
+		if (emu->timed)
+		{
+			emu->convert_ns += end - start;
+		}
+	}
+	if (emu->mix_enabled)
+	{
+		start = emu->timed ? timing_now() : 0;
 		Mixer_End(&emu->mixer, emulator_callback_mixer_complete, emu);
+		if (emu->timed)
+		{
+			emu->mix_ns += timing_now() - start;
+		}
+	}
+#ifdef PROFILE_CALLBACKS
+	profile_frame();
+#endif
+}
+
+void emulator_iterate(emulator * emu)
+{
+	unsigned int i;
+	if (emu->runahead == 0)
+	{
+		emulator_run_frame(emu, cc_true, cc_true);
+		return;
+	}
+	
+	/*
+	 * the real frame goes first and is the only one whose audio is mixed, so audio stays continuous
+	 * then the following frames are emulated on the same input, only rendering the last, and rolled back
+	 */
+	emulator_run_frame(emu, cc_false, cc_true);
+	emulator_capture_state(emu, &emu->runahead_backup);
+	emu->speculating = cc_true;
+	for (i = 1; i < emu->runahead; i++)
+	{
+		emulator_run_frame(emu, cc_false, cc_false);
+	}
+	emulator_run_frame(emu, cc_true, cc_false);
+	emulator_restore_state(emu, &emu->runahead_backup);
+	emu->speculating = cc_false;
+}
+
+/*
+ * emulates a frame without rendering it, and without mixing its audio unless mix is set
+ * the framebuffer and line state are left as they were
+ */
+void emulator_skip_frame(emulator * emu, cc_bool mix)
+{
+	emulator_run_frame(emu, cc_false, mix);
+}
+
+/*
+ * clears the parts of dst that weren't drawn this frame, instead of clearing the whole framebuffer beforehand,
+ * then copies each scaled line down over the rest of its rows
+ */
+static void emulator_finish_lines(emulator * emu, void * dst)
+{
+	int y;
+	unsigned int i;
+	const size_t bytes = convert_pixel_bytes;
+	const size_t pitch = emu->width * emu->scale * bytes;
+	unsigned char * line;
+	uint64_t start;
+	for (y = 0; y < emu->height; y++)
+	{
+		line = (unsigned char *) dst + y * emu->scale * pitch;
+		if (!emu->line_drawn[y])
+		{
+			memset(line, 0, pitch * emu->scale);
+			emu->line_hash[y] = LINE_HASH_BLANK;
+			continue;
+		}
+		memset(line, 0, emu->line_left[y] * emu->scale * bytes);
+		memset(line + emu->line_right[y] * emu->scale * bytes, 0, (emu->width - emu->line_right[y]) * emu->scale * bytes);
+		if (emu->scale > 1)
+		{
+			start = timing_now();
+			for (i = 1; i < emu->scale; i++)
+			{
+				memcpy(line + i * pitch, line, pitch);
+			}
+			emu->scale_ns += timing_now() - start;
+		}
+	}
+}
+
+void emulator_clear_undrawn_lines(emulator * emu)
+{
+	const uint64_t start = emu->timed ? timing_now() : 0;
+	emulator_finish_lines(emu, emu->framebuffer);
+	if (emu->timed)
+	{
+		emu->convert_ns += timing_now() - start;
+	}
+}
+
+/*
+ * turns the indexed frame into pixels in dst, each scanline with the palette it was drawn with,
+ * clearing undrawn parts and hashing each line as it goes
+ */
+void emulator_convert_frame(emulator * emu, void * dst)
+{
+	const uint64_t start = emu->timed ? timing_now() : 0;
+	int y;
+	for (y = 0; y < emu->height; y++)
+	{
+		if (emu->line_drawn[y])
+		{
+			emu->line_hash[y] = emulator_draw_line(emu, dst, y, emu->width, &emu->indices[y * emu->width + emu->line_left[y]], emu->line_palettes[emu->line_palette[y]], emu->line_left[y], emu->line_right[y]);
+		}
+	}
+	emulator_finish_lines(emu, dst);
+	if (emu->timed)
+	{
+		emu->convert_ns += timing_now() - start;
 	}
 }
 
@@ -707,119 +1427,57 @@ void emulator_save_sram(emulator * emu)
 	free(strip);
 }
 
-void emulator_load_state(emulator * emu, const char * filename)
+/* in-memory save states, with no file i/o */
+void emulator_capture_state(emulator * emu, emulator_state * state)
 {
-	char tmp[8];
-	FILE * f;
-	char * path;
-	char * comb;
-	char * strip;
-	size_t read;
-	if (!filename)
-	{
-		strip = strip_ext(emu->cartridge_filename ? emu->cartridge_filename : emu->cd_filename);
-		comb = append_ext(strip, "state");
-		path = build_file_path(get_exe_dir(), comb);
-	}
-	else
+	ClownMDEmu_SaveState(&emu->clownmdemu, &state->state);
+	CDReader_SaveState(&emu->cd, &state->cd);
+	memcpy(state->colors, emu->colors, sizeof(emu->colors));
+}
+
+void emulator_restore_state(emulator * emu, const emulator_state * state)
+{
+	ClownMDEmu_LoadState(&emu->clownmdemu, &state->state);
+	CDReader_LoadState(&emu->cd, &state->cd);
+	memcpy(emu->colors, state->colors, sizeof(emu->colors));
+	emulator_refresh_palette(emu);
+}
+
+/* rebuilds the output palette from the saved one, for after loading a state or changing the pixel format */
+void emulator_refresh_palette(emulator * emu)
+{
+	int i;
+	for (i = 0; i < VDP_TOTAL_COLOURS; i++)
 	{
-		strip = comb = NULL;
-		path = strdup(filename);
+		emu->out_colors[i] = convert_lut[CONVERT_ARGB_TO_COLOR(emu->colors[i])];
 	}
-	if (path)
-	{
-		if (file_exists(path))
-		{
-			if (file_size(path) != (long) save_state_size)
-			{
-				printf("state file size mismatch, got %ld bytes, expected %lu\n", file_size(path), save_state_size);
-			}
-			else
-			{
-				f = file_open_read(path);
-				if (!f)
-				{
-					printf("unable to load state file %s\n", path);
-				}
-				else
-				{
-					read = file_read_bytes(tmp, sizeof(save_state_magic), f);
-					if (read < sizeof(save_state_magic) || strcmp(save_state_magic, tmp) != 0)
-					{
-						printf("state file signature invalid\n");
-					}
-					else
-					{
-						read += file_read_bytes(&emu->state_backup, sizeof(ClownMDEmu_StateBackup), f);
-						read += file_read_bytes(&emu->cd_backup, sizeof(CDReader_StateBackup), f);
-						read += file_read_bytes(emu->colors_backup, sizeof(palette), f);
-						if (read != save_state_size)
-						{
-							printf("state read error, got %lu bytes, expected %lu\n", read, save_state_size);
-						}
-						else
-						{
-							ClownMDEmu_LoadState(&emu->clownmdemu, &emu->state_backup);
-							CDReader_LoadState(&emu->cd, &emu->cd_backup);
-							memcpy(emu->colors, emu->colors_backup, sizeof(emu->colors_backup));
-							printf("state loaded successfully from %s\n", path);
-						}
-					}
-					file_close(f);
-				}
-			}
-		}
-		else
-		{
-			printf("state file %s does not exist\n", path);
-		}
-	}
-	free(path);
-	free(comb);
-	free(strip);
+	emu->palette_dirty = cc_true;
 }
 
-void emulator_save_state(emulator * emu)
+/* the quick save file beside the executable, named after the game */
+char * emulator_state_path(emulator * emu)
 {
-	FILE * f;
 	char * path;
 	char * comb;
 	char * strip;
-	size_t written;
-	f = NULL;
 	strip = strip_ext(emu->cartridge_filename ? emu->cartridge_filename : emu->cd_filename);
 	comb = append_ext(strip, "state");
 	path = build_file_path(get_exe_dir(), comb);
-	if (path)
+	free(comb);
+	free(strip);
+	return path;
+}
+
+void emulator_load_state(emulator * emu, const char * filename)
+{
+	char * path;
+	path = filename ? strdup(filename) : emulator_state_path(emu);
+	if (path && savestate_load(path, &emu->backup))
 	{
-		ClownMDEmu_SaveState(&emu->clownmdemu, &emu->state_backup);
-		CDReader_SaveState(&emu->cd, &emu->cd_backup);
-		memcpy(emu->colors_backup, emu->colors, sizeof(emu->colors));
-		f = file_open_truncate(path);
-		if (f)
-		{
-			written = file_write_bytes(save_state_magic, sizeof(save_state_magic), f);
-			written += file_write_bytes(&emu->state_backup, sizeof(ClownMDEmu_StateBackup), f);
-			written += file_write_bytes(&emu->cd_backup, sizeof(CDReader_StateBackup), f);
-			written += file_write_bytes(&emu->colors_backup, sizeof(palette), f);
-			if (written != save_state_size)
-			{
-				printf("state write error, got %lu bytes, expected %lu\n", written, save_state_size);
-			}
-			else
-			{
-				printf("state saved successfully to %s\n", path);
-			}
-			file_close(f);
-		}
-		else
-		{
-			printf("failed to save state to %s\n", path);
-		}
+		emulator_restore_state(emu, &emu->backup);
+		printf("state loaded successfully from %s\n", path);
 	}
 	free(path);
-	free(comb);
-	free(strip);
 }
 
 void emulator_shutdown_audio(emulator * emu)
@@ -845,4 +1503,8 @@ void emulator_shutdown(emulator * emu)
 		emulator_unload_cartridge(emu);
 	}
 	emulator_shutdown_audio(emu);
+	emulator_set_pipelined(emu, cc_false);
+	free(emu->indices);
+	free(emu->line_palettes);
+	free(emu->scale_row);
 }
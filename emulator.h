@@ -5,12 +5,29 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <pthread.h>
+#include <semaphore.h>
+
 #include "common/core/source/clownmdemu.h"
 #include "common/cd-reader.h"
 #include "common/mixer.h"
 
+#include "logger.h"
+#include "ring_buffer.h"
+
 typedef uint32_t palette[VDP_TOTAL_COLOURS];
 
+/* scratch space for audio generated on frames whose audio is thrown away */
+#define DISCARD_AUDIO_FRAMES 4096
+
+/* everything needed to put the emulator back to an earlier point in time */
+typedef struct emulator_state
+{
+	ClownMDEmu_StateBackup state;
+	CDReader_StateBackup cd;
+	palette colors;
+} emulator_state;
+
 typedef enum region
 {
 	REGION_UNSPECIFIED,
@@ -28,20 +45,67 @@ typedef struct emulator
 	CDReader_State cd;
 	ClownCD_FileCallbacks cd_callbacks;
 	
-	ClownMDEmu_StateBackup state_backup;
-	CDReader_StateBackup cd_backup;
-	palette colors_backup;
+	emulator_state backup;
+	
+	/* run-ahead, emulating extra frames each frame and showing only the last to hide input lag */
+	unsigned int runahead;
+	emulator_state runahead_backup;
+	cc_bool render_enabled;
+	cc_bool mix_enabled;
+	cc_bool speculating;
+	cc_s16l discard_samples[DISCARD_AUDIO_FRAMES * MIXER_CHANNEL_COUNT];
 	
 	cc_bool audio_init;
 	Mixer_State mixer;
 	cc_s16l * samples;
 	size_t audio_bytes;
+	/* dynamic rate control, output frames per mixer frame and the resampler's carried-over state */
+	double resample_ratio;
+	double resample_pos;
+	cc_s16l resample_last[MIXER_CHANNEL_COUNT];
 
 	int rom_size;
 	int width;
 	int height;
-	palette colors;
-	uint32_t * framebuffer;
+	palette colors; /* ARGB8888, as saved in states */
+	palette out_colors; /* the same colours in the output pixel format, what scanlines are drawn with */
+	void * framebuffer; /* output pixels, convert_pixel_bytes each */
+	unsigned int scale; /* frames are drawn this many times their size in each direction */
+	void * scale_row; /* a converted scanline on its way to being scaled */
+	uint64_t scale_ns; /* time spent scaling, in nanoseconds */
+	/* per-scanline state for the current frame, used to skip clearing and uploading unchanged lines */
+	cc_bool line_drawn[VDP_MAX_SCANLINES];
+	cc_u16l line_left[VDP_MAX_SCANLINES];
+	cc_u16l line_right[VDP_MAX_SCANLINES];
+	uint32_t line_hash[VDP_MAX_SCANLINES];
+	uint32_t frame_hash; /* of everything drawn in the last rendered frame, indices and palettes in indexed mode, otherwise pixels */
+	/*
+	 * indexed mode, scanlines are kept as palette indices along with the palette they were drawn with,
+	 * and only turned into pixels when someone asks for them
+	 */
+	cc_bool indexed;
+	cc_u8l * indices;
+	palette * line_palettes; /* every palette used this frame, in order */
+	unsigned int palette_count;
+	cc_bool palette_dirty; /* the palette changed since the last snapshot */
+	cc_u16l line_palette[VDP_MAX_SCANLINES]; /* which snapshot each scanline was drawn with */
+	/*
+	 * pipelined mode, the scanline callback only queues the indices, along with the palette whenever it changes,
+	 * and a worker thread converts them while the core carries on with the next line
+	 */
+	cc_bool pipelined;
+	ring_buffer line_queue;
+	int worker_asleep; /* atomic, the worker is waiting on lines_queued */
+	sem_t lines_queued; /* posted when something is queued while the worker is asleep */
+	sem_t lines_done; /* posted by the worker when it reaches the end of a frame */
+	pthread_t line_worker;
+	palette worker_colors; /* the worker's copy of out_colors */
+	uint64_t pipeline_wait_ns; /* time spent waiting for the worker at the end of frames, in nanoseconds */
+	/* time spent in each part of emulating a frame, only measured when timed is set, in nanoseconds */
+	cc_bool timed;
+	uint64_t core_ns;
+	uint64_t mix_ns;
+	uint64_t convert_ns;
 	cc_bool buttons[2][CLOWNMDEMU_BUTTON_MAX];
 	cc_u16l * rom_buf;
 	char rom_regions[4]; /* includes '\0' at end */
@@ -49,6 +113,7 @@ typedef struct emulator
 	cc_bool log_enabled;
 	
 	FILE * bram;
+	const char * bram_span; /* trace span opened along with bram, which closing it ends */
 	char * cartridge_filename;
 	char * cd_filename;
 	cc_bool cartridge_has_save_ram;
@@ -56,14 +121,19 @@ typedef struct emulator
 	cc_bool cd_inserted;
 } emulator;
 
-void warn(const char * fmt, ...);
-
 void emulator_init(emulator * emu);
 void emulator_init_audio(emulator * emu);
 void emulator_set_region(emulator * emu, region force_region);
 void emulator_set_options(emulator * emu, cc_bool log_enabled, cc_bool widescreen_enabled);
+void emulator_set_runahead(emulator * emu, unsigned int frames);
+int emulator_set_indexed(emulator * emu, cc_bool indexed);
+int emulator_set_scale(emulator * emu, unsigned int scale);
+int emulator_set_pipelined(emulator * emu, cc_bool pipelined);
 void emulator_reset(emulator * emu, cc_bool hard);
 void emulator_iterate(emulator * emu);
+void emulator_skip_frame(emulator * emu, cc_bool mix);
+void emulator_clear_undrawn_lines(emulator * emu);
+void emulator_convert_frame(emulator * emu, void * dst);
 int emulator_load_file(emulator * emu, const char * filename);
 int emulator_load_cartridge(emulator * emu, const char * filename);
 void emulator_unload_cartridge(emulator * emu);
@@ -71,8 +141,11 @@ int emulator_load_cd(emulator * emu, const char * filename);
 void emulator_unload_cd(emulator * emu);
 void emulator_load_sram(emulator * emu);
 void emulator_save_sram(emulator * emu);
+void emulator_capture_state(emulator * emu, emulator_state * state);
+void emulator_restore_state(emulator * emu, const emulator_state * state);
+void emulator_refresh_palette(emulator * emu);
+char * emulator_state_path(emulator * emu);
 void emulator_load_state(emulator * emu, const char * filename);
-void emulator_save_state(emulator * emu);
 void emulator_shutdown_audio(emulator * emu);
 void emulator_shutdown(emulator * emu);
 
@@ -0,0 +1,89 @@
+#include "histogram.h"
+
+#include <string.h>
+
+#define HISTOGRAM_SUB_COUNT (1U << HISTOGRAM_SUB_BITS)
+
+static unsigned int histogram_index(uint64_t value)
+{
+	unsigned int shift;
+	if (value < 2 * HISTOGRAM_SUB_COUNT)
+	{
+		/* small values get a bucket each */
+		return (unsigned int) value;
+	}
+	/* keep the top HISTOGRAM_SUB_BITS + 1 bits, the topmost of which is always set */
+	shift = 64 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS - 1;
+	return shift * HISTOGRAM_SUB_COUNT + (unsigned int) (value >> shift);
+}
+
+/* the middle of a bucket's range, which is what gets reported for values in it */
+static uint64_t histogram_value(unsigned int index)
+{
+	unsigned int shift;
+	if (index < 2 * HISTOGRAM_SUB_COUNT)
+	{
+		return index;
+	}
+	shift = index / HISTOGRAM_SUB_COUNT - 1;
+	return ((uint64_t) (index % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT) << shift) + ((uint64_t) 1 << shift) / 2;
+}
+
+void histogram_reset(histogram * h)
+{
+	memset(h, 0, sizeof(histogram));
+}
+
+void histogram_add(histogram * h, uint64_t value)
+{
+	if (value >= (uint64_t) 1 << HISTOGRAM_MAX_BITS)
+	{
+		value = ((uint64_t) 1 << HISTOGRAM_MAX_BITS) - 1;
+	}
+	h->buckets[histogram_index(value)]++;
+	if (h->count == 0 || value < h->min)
+	{
+		h->min = value;
+	}
+	if (value > h->max)
+	{
+		h->max = value;
+	}
+	h->count++;
+	h->sum += value;
+}
+
+uint64_t histogram_percentile(const histogram * h, double percentile)
+{
+	uint64_t target;
+	uint64_t seen;
+	uint64_t value;
+	unsigned int i;
+	
+	if (h->count == 0)
+	{
+		return 0;
+	}
+	target = (uint64_t) (h->count * percentile / 100.0);
+	if (target < 1)
+	{
+		target = 1;
+	}
+	seen = 0;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+		if (seen >= target)
+		{
+			/* the exact extremes are known, so never report past them */
+			value = histogram_value(i);
+			return value < h->min ? h->min : value > h->max ? h->max : value;
+		}
+	}
+	return h->max;
+}
+
+double histogram_mean(const histogram * h)
+{
+	return h->count > 0 ? (double) h->sum / h->count : 0.0;
+}
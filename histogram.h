@@ -0,0 +1,43 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * log-linear buckets in the style of HdrHistogram, each power of 2 is split into
+ * 2^HISTOGRAM_SUB_BITS buckets, so any recorded value is off by at most 1/64 of itself
+ */
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_MAX_BITS 40 /* values are clamped to 2^40 - 1, about 18 minutes in nanoseconds */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct histogram
+{
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+} histogram;
+
+/*
+ * empties a histogram
+ */
+void histogram_reset(histogram * h);
+
+/*
+ * records a single value, never allocates
+ */
+void histogram_add(histogram * h, uint64_t value);
+
+/*
+ * gets the value below which percentile percent of the recorded values fall, 0 if nothing was recorded
+ */
+uint64_t histogram_percentile(const histogram * h, double percentile);
+
+/*
+ * gets the mean of the recorded values, 0 if nothing was recorded
+ */
+double histogram_mean(const histogram * h);
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,274 @@
+#include "logger.h"
+#include "atomic.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * a bounded queue of fixed-size records that any thread can add to, with the logger thread as the only reader
+ * each record's sequence says whose turn it is: equal to a position, it's free for the producer that claims
+ * that position, one past it, it holds that position's message for the logger thread
+ */
+typedef struct logger_record
+{
+	unsigned long sequence; /* atomic */
+	logger_source source;
+	char text[LOGGER_TEXT_SIZE];
+} logger_record;
+
+typedef struct logger_limit
+{
+	unsigned long second; /* atomic, the second count is for */
+	unsigned int count; /* atomic, messages logged during that second */
+	unsigned long limited; /* atomic, dropped for going over the rate limit */
+	unsigned long overflowed; /* atomic, dropped because every record was in use */
+	unsigned long reported; /* drops already reported, only touched by the logger thread */
+} logger_limit;
+
+static const char * const logger_prefixes[LOGGER_SOURCE_COUNT] = { "core: ", "clowncd: ", "WARN: ", "" };
+static const char * const logger_names[LOGGER_SOURCE_COUNT] = { "core", "clowncd", "warning", "info" };
+
+/* NOTE: global variables! warn() is called from everywhere, with nowhere to pass a logger in */
+static logger_record logger_records[LOGGER_RECORDS];
+static logger_limit logger_limits[LOGGER_SOURCE_COUNT];
+static unsigned long logger_head; /* atomic, next position to claim, shared by every producer */
+static unsigned long logger_tail; /* next position to write out, only touched by the logger thread */
+static int logger_running; /* atomic */
+static int logger_quit; /* atomic */
+static int logger_asleep; /* atomic, the logger thread is waiting for a post */
+static sem_t logger_wake;
+static pthread_t logger_thread_id;
+
+/* prints a message in full, if there's no thread to hand it to */
+static void logger_write_sync(logger_source source, const char * fmt, va_list args)
+{
+	size_t length = strlen(fmt);
+	printf("%s", logger_prefixes[source]);
+	vprintf(fmt, args);
+	if (length == 0 || fmt[length - 1] != '\n')
+	{
+		printf("\n");
+	}
+}
+
+static int logger_pending(void)
+{
+	return atomic_get(&logger_records[logger_tail & (LOGGER_RECORDS - 1)].sequence) == logger_tail + 1;
+}
+
+/* writes out every message that's ready, in the order their records were claimed */
+static void logger_drain(void)
+{
+	logger_record * rec;
+	size_t length;
+	while (logger_pending())
+	{
+		rec = &logger_records[logger_tail & (LOGGER_RECORDS - 1)];
+		length = strlen(rec->text);
+		fputs(logger_prefixes[rec->source], stdout);
+		fputs(rec->text, stdout);
+		if (length == 0 || rec->text[length - 1] != '\n')
+		{
+			fputc('\n', stdout);
+		}
+		/* hand the record back for the position a lap ahead */
+		atomic_set(&rec->sequence, logger_tail + LOGGER_RECORDS);
+		logger_tail++;
+	}
+}
+
+static void logger_report_drops(void)
+{
+	logger_limit * limit;
+	unsigned long dropped;
+	int i;
+	for (i = 0; i < LOGGER_SOURCE_COUNT; i++)
+	{
+		limit = &logger_limits[i];
+		dropped = atomic_get(&limit->limited) + atomic_get(&limit->overflowed);
+		if (dropped != limit->reported)
+		{
+			printf("log: %lu %s messages dropped\n", dropped - limit->reported, logger_names[i]);
+			limit->reported = dropped;
+		}
+	}
+}
+
+static void * logger_thread(void * arg)
+{
+	(void) arg;
+	for (;;)
+	{
+		logger_drain();
+		logger_report_drops();
+		fflush(stdout);
+		
+		/* same handshake as the line worker, producers only post if they see this */
+		atomic_set(&logger_asleep, 1);
+		atomic_fence();
+		if (!logger_pending())
+		{
+			if (atomic_get(&logger_quit))
+			{
+				break;
+			}
+			while (sem_wait(&logger_wake) != 0 && errno == EINTR)
+			{
+			}
+		}
+		atomic_set(&logger_asleep, 0);
+	}
+	return NULL;
+}
+
+/* returns false if the source has already logged its share this second */
+static int logger_allow(logger_limit * limit)
+{
+	unsigned long second = (unsigned long) (timing_monotonic() / 1000000000);
+	unsigned long current = atomic_get(&limit->second);
+	if (current != second && atomic_cas(&limit->second, &current, second))
+	{
+		/* a message counted against the old second by another thread in between is simply forgiven */
+		atomic_set(&limit->count, 0);
+	}
+	if (atomic_add(&limit->count, 1) >= LOGGER_RATE_LIMIT)
+	{
+		atomic_add(&limit->limited, 1);
+		return 0;
+	}
+	return 1;
+}
+
+/* claims the next free record, returning its position through pos, or NULL if every one is in use */
+static logger_record * logger_claim(unsigned long * pos)
+{
+	logger_record * rec;
+	unsigned long p = atomic_get(&logger_head);
+	long diff;
+	for (;;)
+	{
+		rec = &logger_records[p & (LOGGER_RECORDS - 1)];
+		diff = (long) (atomic_get(&rec->sequence) - p);
+		if (diff == 0)
+		{
+			/* on failure p is updated to wherever another producer moved the head */
+			if (atomic_cas(&logger_head, &p, p + 1))
+			{
+				*pos = p;
+				return rec;
+			}
+		}
+		else if (diff < 0)
+		{
+			/* still holding the message from a lap behind */
+			return NULL;
+		}
+		else
+		{
+			p = atomic_get(&logger_head);
+		}
+	}
+}
+
+void logger_init(void)
+{
+	unsigned long i;
+	for (i = 0; i < LOGGER_RECORDS; i++)
+	{
+		logger_records[i].sequence = i;
+	}
+	logger_head = logger_tail = 0;
+	logger_quit = 0;
+	logger_asleep = 0;
+	if (sem_init(&logger_wake, 0, 0) != 0)
+	{
+		printf("unable to init logger semaphore, logging synchronously\n");
+		return;
+	}
+	if (pthread_create(&logger_thread_id, NULL, logger_thread, NULL) != 0)
+	{
+		printf("unable to start logger thread, logging synchronously\n");
+		sem_destroy(&logger_wake);
+		return;
+	}
+	atomic_set(&logger_running, 1);
+}
+
+void logger_write(logger_source source, const char * fmt, va_list args)
+{
+	logger_record * rec;
+	unsigned long pos;
+	if (!atomic_get(&logger_running))
+	{
+		logger_write_sync(source, fmt, args);
+		return;
+	}
+	if (!logger_allow(&logger_limits[source]))
+	{
+		return;
+	}
+	rec = logger_claim(&pos);
+	if (!rec)
+	{
+		atomic_add(&logger_limits[source].overflowed, 1);
+		return;
+	}
+	rec->source = source;
+	vsnprintf(rec->text, sizeof(rec->text), fmt, args);
+	atomic_set(&rec->sequence, pos + 1);
+	
+	/* the fence pairs with the one in the logger thread */
+	atomic_fence();
+	if (atomic_get(&logger_asleep) && atomic_swap(&logger_asleep, 0))
+	{
+		sem_post(&logger_wake);
+	}
+}
+
+void logger_printf(logger_source source, const char * fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	logger_write(source, fmt, args);
+	va_end(args);
+}
+
+void logger_shutdown(void)
+{
+	unsigned long limited;
+	unsigned long overflowed;
+	int i;
+	if (!atomic_get(&logger_running))
+	{
+		return;
+	}
+	atomic_set(&logger_quit, 1);
+	atomic_fence();
+	sem_post(&logger_wake);
+	pthread_join(logger_thread_id, NULL);
+	sem_destroy(&logger_wake);
+	atomic_set(&logger_running, 0);
+	
+	limited = overflowed = 0;
+	for (i = 0; i < LOGGER_SOURCE_COUNT; i++)
+	{
+		limited += logger_limits[i].limited;
+		overflowed += logger_limits[i].overflowed;
+	}
+	if (limited + overflowed > 0)
+	{
+		printf("log: %lu messages dropped in all, %lu over the rate limit of %d a second and %lu with every record in use\n", limited + overflowed, limited, LOGGER_RATE_LIMIT, overflowed);
+	}
+}
+
+void warn(const char * fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	logger_write(LOGGER_WARN, fmt, args);
+	va_end(args);
+}
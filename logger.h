@@ -0,0 +1,50 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdarg.h>
+
+/* each source is rate limited separately, so a noisy core can't drown out warnings */
+typedef enum logger_source
+{
+	LOGGER_CORE,
+	LOGGER_CLOWNCD,
+	LOGGER_WARN,
+	LOGGER_INFO, /* the frontend's own status messages, printed without a prefix */
+	LOGGER_SOURCE_COUNT
+} logger_source;
+
+/* records that can be waiting to be written at once, a power of 2 */
+#define LOGGER_RECORDS 1024
+
+/* longest message kept, anything longer is cut short */
+#define LOGGER_TEXT_SIZE 240
+
+/* messages each source may log per second, the rest are dropped and counted */
+#define LOGGER_RATE_LIMIT 1000
+
+/*
+ * starts the thread that writes messages out
+ * until then, after logger_shutdown(), or if the thread can't be started, messages are written synchronously
+ */
+void logger_init(void);
+
+/*
+ * formats a message into a preallocated record for the logger thread to write, from any thread
+ * never blocks or allocates, a message is dropped instead if its source is over the rate limit or every record is in use
+ * a newline is added if the message doesn't end with one
+ */
+void logger_write(logger_source source, const char * fmt, va_list args);
+void logger_printf(logger_source source, const char * fmt, ...);
+
+/*
+ * writes out anything still waiting, stops the thread and reports what was dropped
+ * only once every other thread that logs has been joined
+ */
+void logger_shutdown(void);
+
+/*
+ * logs a warning
+ */
+void warn(const char * fmt, ...);
+
+#endif /* LOGGER_H */
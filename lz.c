@@ -0,0 +1,190 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * each sequence is a token (literal count in the high nibble, match length - LZ_MIN_MATCH in the low nibble),
+ * extra literal count bytes if the nibble is 15, the literals, a little-endian 16-bit match offset and
+ * extra match length bytes if the nibble is 15
+ * the final sequence has literals only
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+static uint32_t lz_read32(const unsigned char * p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char * lz_write_length(unsigned char * op, size_t len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char) len;
+	return op;
+}
+
+size_t lz_bound(size_t src_size)
+{
+	return src_size + src_size / 255 + 16;
+}
+
+size_t lz_compress(const unsigned char * src, size_t src_size, unsigned char * dst, size_t dst_capacity)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const unsigned char * ip = src;
+	const unsigned char * anchor = src;
+	const unsigned char * end = src + src_size;
+	const unsigned char * ref;
+	unsigned char * op = dst;
+	unsigned char * token;
+	size_t literals;
+	size_t match;
+	uint32_t h;
+	
+	if (dst_capacity < lz_bound(src_size))
+	{
+		return 0;
+	}
+	
+	/* position + 1, so 0 means empty */
+	memset(table, 0, sizeof(table));
+	
+	while (ip + LZ_MIN_MATCH <= end)
+	{
+		h = lz_hash(lz_read32(ip));
+		ref = table[h] ? src + table[h] - 1 : NULL;
+		table[h] = (uint32_t) (ip - src) + 1;
+		if (!ref || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != lz_read32(ip))
+		{
+			ip++;
+			continue;
+		}
+		
+		match = LZ_MIN_MATCH;
+		while (ip + match < end && ref[match] == ip[match])
+		{
+			match++;
+		}
+		
+		literals = ip - anchor;
+		token = op++;
+		*token = (unsigned char) ((literals >= 15 ? 15 : literals) << 4);
+		if (literals >= 15)
+		{
+			op = lz_write_length(op, literals - 15);
+		}
+		memcpy(op, anchor, literals);
+		op += literals;
+		
+		*op++ = (unsigned char) ((ip - ref) & 0xFF);
+		*op++ = (unsigned char) ((ip - ref) >> 8);
+		*token |= (unsigned char) (match - LZ_MIN_MATCH >= 15 ? 15 : match - LZ_MIN_MATCH);
+		if (match - LZ_MIN_MATCH >= 15)
+		{
+			op = lz_write_length(op, match - LZ_MIN_MATCH - 15);
+		}
+		
+		ip += match;
+		anchor = ip;
+	}
+	
+	literals = end - anchor;
+	token = op++;
+	*token = (unsigned char) ((literals >= 15 ? 15 : literals) << 4);
+	if (literals >= 15)
+	{
+		op = lz_write_length(op, literals - 15);
+	}
+	memcpy(op, anchor, literals);
+	op += literals;
+	return op - dst;
+}
+
+size_t lz_decompress(const unsigned char * src, size_t src_size, unsigned char * dst, size_t dst_capacity)
+{
+	const unsigned char * ip = src;
+	const unsigned char * end = src + src_size;
+	unsigned char * op = dst;
+	unsigned char * op_end = dst + dst_capacity;
+	const unsigned char * ref;
+	size_t literals;
+	size_t match;
+	size_t offset;
+	unsigned char token;
+	
+	while (ip < end)
+	{
+		token = *ip++;
+		literals = token >> 4;
+		if (literals == 15)
+		{
+			do
+			{
+				if (ip >= end)
+				{
+					return 0;
+				}
+				literals += *ip;
+			}
+			while (*ip++ == 255);
+		}
+		if (literals > (size_t) (end - ip) || literals > (size_t) (op_end - op))
+		{
+			return 0;
+		}
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+		
+		if (ip == end)
+		{
+			/* final sequence */
+			break;
+		}
+		
+		if (end - ip < 2)
+		{
+			return 0;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		match = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15)
+		{
+			do
+			{
+				if (ip >= end)
+				{
+					return 0;
+				}
+				match += *ip;
+			}
+			while (*ip++ == 255);
+		}
+		if (offset == 0 || offset > (size_t) (op - dst) || match > (size_t) (op_end - op))
+		{
+			return 0;
+		}
+		
+		/* byte by byte, since the match may overlap what it's copying */
+		ref = op - offset;
+		while (match-- > 0)
+		{
+			*op++ = *ref++;
+		}
+	}
+	return op - dst;
+}
@@ -0,0 +1,28 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/*
+ * small and fast lz77 compressor, using an lz4-style block format
+ * long runs of the same byte (such as the zeros in an xor delta) become a single overlapping match
+ */
+
+/*
+ * gets the largest possible compressed size of src_size bytes
+ */
+size_t lz_bound(size_t src_size);
+
+/*
+ * compresses src into dst
+ * returns the compressed size, or 0 if it doesn't fit in dst_capacity
+ */
+size_t lz_compress(const unsigned char * src, size_t src_size, unsigned char * dst, size_t dst_capacity);
+
+/*
+ * decompresses src into dst
+ * returns the decompressed size, or 0 if the data is corrupt or doesn't fit in dst_capacity
+ */
+size_t lz_decompress(const unsigned char * src, size_t src_size, unsigned char * dst, size_t dst_capacity);
+
+#endif /* LZ_H */
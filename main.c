@@ -18,36 +18,104 @@
  * f     = mode
  * enter = start
  * tab   = soft reset
+ * f5    = quick save to the selected slot
+ * f8    = quick load from the selected slot
+ * 0-9   = select save state slot
+ * bksp  = rewind (hold, needs --rewind)
+ * space = toggle fast-forward
  * esc   = exit
  */
 
 #include "emulator.h"
 #include "file.h"
 #include "path.h"
+#include "timing.h"
+#include "bench.h"
+#include "perf.h"
+#include "phases.h"
+#include "profile.h"
+#include "trace.h"
+#include "display.h"
+#include "triple_buffer.h"
+#include "atomic.h"
+#include "audio.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "slots.h"
+#include "convert.h"
 
-#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
 
-/* CLOCK_MONOTONIC_RAW is linux-only */
-#ifndef CLOCK_MONOTONIC_RAW
-#define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
-#endif
+#define ROM_SIZE_MAX 0x800000
 
-#ifndef DISABLE_AUDIO
-#if defined(__linux__)
-#include <pulse/simple.h>
-#include <pulse/error.h>
-#elif defined(__OpenBSD__)
-#include <sndio.h>
-#endif
-#endif
+/* mega drive master clock and frame length, for the exact ntsc (~59.92 Hz) and pal (~49.70 Hz) refresh rates */
+#define MASTER_CLOCK_NTSC 53693175
+#define MASTER_CLOCK_PAL 53203424
+#define MASTER_CYCLES_PER_SCANLINE 3420
+#define SCANLINES_PER_FRAME_NTSC 262
+#define SCANLINES_PER_FRAME_PAL 313
 
-#include <X11/Xlib.h>
-#include <X11/Xutil.h>
-#include <X11/Xatom.h>
-#include <X11/XKBlib.h>
+/* each frame of run-ahead costs a whole extra frame of emulation */
+#define RUNAHEAD_MAX 8
+
+/* most frames frameskip may skip in a row, beyond this the game slows down instead */
+#define FRAMESKIP_MAX 9
+
+/* hotkey requests carried out by the emulation thread */
+#define COMMAND_RESET 1
+#define COMMAND_SAVE_STATE 2
+#define COMMAND_LOAD_STATE 4
+
+/* details of a completed frame that travel with its display buffer */
+typedef struct frame_info
+{
+	int width;
+	int height;
+	uint64_t finished; /* CLOCK_MONOTONIC time the frame was published */
+	uint32_t line_hash[VDP_MAX_SCANLINES];
+} frame_info;
+
+/* state shared between the presentation (main) thread and the emulation thread */
+typedef struct session
+{
+	emulator * emu;
+	display * disp;
+	triple_buffer frames;
+	frame_info frame_info[DISPLAY_BUFFER_COUNT];
+	pacer frame_pacer;
+	bench * frame_bench;
+	phases * frame_phases; /* NULL unless timing each phase of a frame */
+	perf_counters * frame_perf; /* NULL unless counting cpu events, opened by the emulation thread */
+	long frame_limit;
+	cc_bool audio_sync; /* audio device paces emulation instead of the frame pacer */
+	cc_bool display_sync; /* frame pacer is phase-locked to the display's vblanks */
+	cc_bool display_mismatch; /* the display's refresh rate was too far off to lock to, so it's video sync in all but name */
+	int wake_pipe[2]; /* written by the emulation thread when there's something for the presentation thread */
+	unsigned int input; /* presentation thread's copy of player 1's buttons */
+	unsigned int buttons[2]; /* atomic, one bit per ClownMDEmu_Button */
+	unsigned int commands; /* atomic, COMMAND_* flags */
+	rewind_buffer * history; /* NULL if rewind is disabled */
+	state_slots * slots; /* NULL if they couldn't be allocated */
+	unsigned int slot; /* atomic, save state slot picked by the presentation thread */
+	int rewinding; /* atomic, rewind hotkey is held */
+	int fast_forward; /* atomic, toggled by the presentation thread */
+	unsigned int fast_forward_speed; /* frames emulated per frame shown, 0 for as many as fit in a frame */
+	unsigned long fast_forward_frames; /* frames emulated but never shown */
+	unsigned int frameskip_max; /* frames that may be skipped in a row when running behind, 0 to never skip */
+	unsigned long frames_shown;
+	unsigned long frames_skipped;
+	unsigned int frameskip_longest; /* longest run of skipped frames */
+	unsigned long frames_duplicate; /* identical to the frame before, so never converted or uploaded */
+	uint32_t published_hash; /* frame hash of the last frame handed to the presentation thread */
+	cc_bool published; /* published_hash is valid */
+	int quit; /* atomic, set by the presentation thread */
+	int finished; /* atomic, set by the emulation thread */
+	audio output;
+} session;
 
-#define BILLION 1000000000L
-#define ROM_SIZE_MAX 0x800000
 #define FRAMEBUFFER_SIZE VDP_MAX_SCANLINE_WIDTH * VDP_MAX_SCANLINES * sizeof(uint32_t)
 
 static void usage(const char * app_name)
@@ -62,59 +130,481 @@ static void usage(const char * app_name)
 		"\t-s FILE    Load save state from specified file\n"
 		"\t-c FILE    Load specified file as a cartridge\n"
 		"\t-d FILE    Load specified file as a disc\n"
-		"\t-v         List Git version hashes (Git builds only)\n",
-		app_name
+		"\t-v         List Git version hashes (Git builds only)\n"
+		"\t--headless Run without a window or audio output\n"
+		"\t--frames N Stop after N frames\n"
+		"\t--scale N  Scale the picture up N times (1-%d, default fits the screen in fullscreen, otherwise 1)\n"
+		"\t--fullscreen\n"
+		"\t           Fill the screen\n"
+		"\t--present  Show frames at vblank through the X Present extension, without tearing\n"
+		"\t--depth N  Use an N-bit X visual, such as 16 for remote displays (default is the screen's depth)\n"
+		"\t--indexed  Keep frames as palette indices, only converting frames that are shown\n"
+		"\t--pipeline Convert scanlines on a worker thread while the core emulates the next ones\n"
+		"\t--bench    Report frame rate and frame time statistics at exit\n"
+		"\t--bench-convert\n"
+		"\t           Measure scanline conversion speed and exit\n"
+		"\t--spin US  Busy-wait for the last US microseconds before each frame deadline\n"
+		"\t--jitter   Report frame pacing jitter at exit\n"
+		"\t--phases   Report how long each phase of a frame takes at exit\n"
+		"\t--phases-csv FILE\n"
+		"\t           Also write phase timings to FILE as CSV, every 5 seconds unless --phases-interval is given\n"
+		"\t--phases-interval N\n"
+		"\t           Write phase timings to the CSV file every N seconds\n"
+		"\t--perf     Report cycles, instructions, cache and branch misses per frame spent emulating at exit\n"
+		"\t--trace FILE\n"
+		"\t           Record a timeline of frames, state saves, CD and save file access and audio writes,\n"
+		"\t           written to FILE at exit as Chrome trace event JSON (for Perfetto or chrome://tracing)\n"
+		"\t--audio-depth MS\n"
+		"\t           Buffer MS milliseconds of audio (default %d)\n"
+		"\t--audio-stats\n"
+		"\t           Report audio underruns and overruns at exit\n"
+		"\t--sync (video|audio|display)\n"
+		"\t           Pace emulation with the frame timer (default), the audio device or the\n"
+		"\t           display's refresh (needs --present)\n"
+		"\t--run-ahead N\n"
+		"\t           Emulate N frames ahead to hide input lag (0-%d)\n"
+		"\t--rewind MB\n"
+		"\t           Keep up to MB megabytes of rewind history (hold backspace to rewind)\n"
+		"\t--rewind-interval N\n"
+		"\t           Take a rewind snapshot every N frames (default 1)\n"
+		"\t--state-slots N\n"
+		"\t           Keep N quick save slots, picked with the number keys (1-%d, default %d)\n"
+		"\t--memory-states\n"
+		"\t           Keep quick save slots in memory only, never writing state files\n"
+		"\t--frameskip N\n"
+		"\t           Skip drawing up to N frames in a row when running behind (1-%d)\n"
+		"\t--fast-forward\n"
+		"\t           Start in fast-forward (space toggles it)\n"
+		"\t--fast-forward-speed (N|max)\n"
+		"\t           Fast-forward at N times normal speed, or as fast as possible (default)\n",
+		app_name,
+		DISPLAY_SCALE_MAX,
+		AUDIO_DEFAULT_DEPTH_MS,
+		RUNAHEAD_MAX,
+		SLOTS_MAX,
+		SLOTS_MAX,
+		FRAMESKIP_MAX
 	);
 }
 
-static void toggle_key(emulator * emu, int keysym, cc_bool down)
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_interrupt(int sig)
+{
+	(void) sig;
+	interrupted = 1;
+}
+
+/* hands the time the emulator measured this frame over to the phase histograms, then starts afresh */
+static void record_emulator_phases(phases * p, emulator * emu, uint64_t now)
+{
+	phases_add(p, PHASE_CORE, emu->core_ns, now);
+	phases_add(p, PHASE_MIX, emu->mix_ns, now);
+	phases_add(p, PHASE_CONVERT, emu->convert_ns, now);
+	emu->core_ns = emu->mix_ns = emu->convert_ns = 0;
+}
+
+/*
+ * runs the emulator without any video or audio output, as fast as possible
+ * frames = 0 runs until interrupted
+ */
+static void run_headless(emulator * emu, long frames, bench * b, rewind_buffer * r, phases * p, perf_counters * c)
 {
+	long frame;
+	uint64_t start;
+	
+	signal(SIGINT, handle_interrupt);
+	signal(SIGTERM, handle_interrupt);
+	
+	trace_thread_name("emulation");
+	if (c)
+	{
+		perf_open(c);
+	}
+	if (b)
+	{
+		bench_begin(b);
+	}
+	for (frame = 0; !interrupted && (frames == 0 || frame < frames); frame++)
+	{
+		start = timing_now();
+		TRACE_BEGIN("frame");
+		TRACE_BEGIN("emulator_iterate");
+		if (c)
+		{
+			perf_begin(c);
+		}
+		emulator_iterate(emu);
+		if (c)
+		{
+			perf_end(c);
+		}
+		TRACE_END("emulator_iterate");
+		if (r)
+		{
+			rewind_capture(r, emu);
+		}
+		TRACE_END("frame");
+		if (p)
+		{
+			record_emulator_phases(p, emu, timing_now());
+		}
+		if (b)
+		{
+			bench_add(b, timing_now() - start);
+		}
+	}
+	if (b)
+	{
+		bench_end(b);
+	}
+	if (c)
+	{
+		perf_close(c);
+	}
+}
+
+static void select_slot(session * s, unsigned int slot)
+{
+	if (!s->slots || slot >= s->slots->count)
+	{
+		logger_printf(LOGGER_INFO, "no save state slot %u, there are %u\n", slot, s->slots ? s->slots->count : 0);
+		return;
+	}
+	atomic_set(&s->slot, slot);
+	logger_printf(LOGGER_INFO, "save state slot %u selected\n", slot);
+}
+
+static void toggle_key(session * s, int keysym, cc_bool down)
+{
+	int button;
 	switch (keysym)
 	{
 		case XK_Up:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_UP] = down;
+			button = CLOWNMDEMU_BUTTON_UP;
 			break;
 		case XK_Down:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_DOWN] = down;
+			button = CLOWNMDEMU_BUTTON_DOWN;
 			break;
 		case XK_Left:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_LEFT] = down;
+			button = CLOWNMDEMU_BUTTON_LEFT;
 			break;
 		case XK_Right:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_RIGHT] = down;
+			button = CLOWNMDEMU_BUTTON_RIGHT;
 			break;
 		case XK_q:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_X] = down;
+			button = CLOWNMDEMU_BUTTON_X;
 			break;
 		case XK_w:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_Y] = down;
+			button = CLOWNMDEMU_BUTTON_Y;
 			break;
 		case XK_e:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_Z] = down;
+			button = CLOWNMDEMU_BUTTON_Z;
 			break;
 		case XK_a:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_A] = down;
+			button = CLOWNMDEMU_BUTTON_A;
 			break;
 		case XK_s:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_B] = down;
+			button = CLOWNMDEMU_BUTTON_B;
 			break;
 		case XK_d:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_C] = down;
+			button = CLOWNMDEMU_BUTTON_C;
 			break;
 		case XK_f:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_MODE] = down;
+			button = CLOWNMDEMU_BUTTON_MODE;
 			break;
 		case XK_Return:
-			emu->buttons[0][CLOWNMDEMU_BUTTON_START] = down;
+			button = CLOWNMDEMU_BUTTON_START;
+			break;
+		default:
+			return;
+	}
+	if (down)
+	{
+		s->input |= 1U << button;
+	}
+	else
+	{
+		s->input &= ~(1U << button);
+	}
+	atomic_set(&s->buttons[0], s->input);
+}
+
+static void session_wake(session * s)
+{
+	char byte = 0;
+	if (write(s->wake_pipe[1], &byte, sizeof(byte)) < 0)
+	{
+		/* pipe is full, so the presentation thread has a wakeup pending anyway */
+	}
+}
+
+static void * emulation_thread(void * arg)
+{
+	session * s = (session *) arg;
+	emulator * emu = s->emu;
+	frame_info * info;
+	long frame;
+	int back;
+	int player;
+	int button;
+	unsigned int buttons;
+	unsigned int commands;
+	uint64_t start;
+	cc_bool rewound;
+	cc_bool fast_forward;
+	cc_bool frameskip;
+	unsigned int skip;
+	uint64_t vblank;
+	uint64_t refresh;
+	uint64_t phase_start;
+	
+	frame = 0;
+	back = s->frames.back;
+	trace_thread_name("emulation");
+	if (s->frame_perf)
+	{
+		/* counters only follow the thread that opens them */
+		perf_open(s->frame_perf);
+	}
+	if (s->frame_bench)
+	{
+		bench_begin(s->frame_bench);
+	}
+	while (!atomic_get(&s->quit))
+	{
+		start = timing_now();
+		TRACE_BEGIN("frame");
+		
+		/* pick up the latest input and hotkeys from the presentation thread */
+		for (player = 0; player < 2; player++)
+		{
+			buttons = atomic_get(&s->buttons[player]);
+			for (button = 0; button < CLOWNMDEMU_BUTTON_MAX; button++)
+			{
+				emu->buttons[player][button] = (buttons >> button) & 1 ? cc_true : cc_false;
+			}
+		}
+		commands = atomic_swap(&s->commands, 0);
+		if (commands & COMMAND_RESET)
+		{
+			emulator_reset(emu, cc_false);
+		}
+		if (commands & COMMAND_SAVE_STATE && s->slots)
+		{
+			TRACE_BEGIN("save_state");
+			slots_save(s->slots, atomic_get(&s->slot), emu);
+			TRACE_END("save_state");
+		}
+		if (commands & COMMAND_LOAD_STATE && s->slots)
+		{
+			TRACE_BEGIN("load_state");
+			slots_load(s->slots, atomic_get(&s->slot), emu);
+			TRACE_END("load_state");
+		}
+		if (s->slots && s->slots->writer)
+		{
+			slots_persist(s->slots, start);
+		}
+		
+		/* the scanline callback renders straight into the buffer handed to the server */
+		emu->framebuffer = display_get_framebuffer(s->disp, back);
+		
+		/*
+		 * fast-forward emulates the extra frames without rendering or mixing, only the last is shown
+		 * and heard, so the audio is decimated rather than piling up in the ring
+		 */
+		fast_forward = atomic_get(&s->fast_forward) ? cc_true : cc_false;
+		if (fast_forward)
+		{
+			if (s->fast_forward_speed == 0)
+			{
+				while (timing_now() - start < s->frame_pacer.period && !atomic_get(&s->quit))
+				{
+					emulator_skip_frame(emu, cc_false);
+					s->fast_forward_frames++;
+				}
+			}
+			else
+			{
+				for (skip = 1; skip < s->fast_forward_speed; skip++)
+				{
+					emulator_skip_frame(emu, cc_false);
+					s->fast_forward_frames++;
+				}
+			}
+		}
+		
+		/*
+		 * frameskip, when the last frame made us miss whole periods, emulate without drawing until
+		 * caught up, keeping the audio so the game doesn't slow down, and only give up and resync
+		 * once the last skip allowed still leaves us behind
+		 */
+		frameskip = s->frameskip_max > 0 && !s->audio_sync && !fast_forward ? cc_true : cc_false;
+		if (frameskip)
+		{
+			for (skip = 0; skip < s->frameskip_max && pacer_behind(&s->frame_pacer) > 0 && !atomic_get(&s->quit); skip++)
+			{
+				emulator_skip_frame(emu, cc_true);
+				audio_queue(&s->output, emu->samples, emu->audio_bytes);
+				emu->audio_bytes = 0;
+				s->frames_skipped++;
+				pacer_wait(&s->frame_pacer, skip + 1 < s->frameskip_max ? PACER_KEEP_SCHEDULE : 0);
+			}
+			if (skip > s->frameskip_longest)
+			{
+				s->frameskip_longest = skip;
+			}
+		}
+		s->frames_shown++;
+		
+		/* while rewinding, step back a snapshot and emulate from there so there's a picture to show */
+		rewound = s->history && atomic_get(&s->rewinding) && rewind_step(s->history, emu) ? cc_true : cc_false;
+		
+		TRACE_BEGIN("emulator_iterate");
+		if (s->frame_perf)
+		{
+			perf_begin(s->frame_perf);
+		}
+		emulator_iterate(emu);
+		if (s->frame_perf)
+		{
+			perf_end(s->frame_perf);
+		}
+		TRACE_END("emulator_iterate");
+		
+		if (s->history && !rewound)
+		{
+			rewind_capture(s->history, emu);
+		}
+		
+		if (emu->width > 0 && emu->height > 0 && s->published && emu->frame_hash == s->published_hash)
+		{
+			/* same as what's on screen, e.g. a pause screen, so don't convert it or wake anyone up */
+			s->frames_duplicate++;
+		}
+		else if (emu->width > 0 && emu->height > 0)
+		{
+			s->published_hash = emu->frame_hash;
+			s->published = cc_true;
+			if (emu->indexed)
+			{
+				emulator_convert_frame(emu, emu->framebuffer);
+			}
+			else
+			{
+				emulator_clear_undrawn_lines(emu);
+			}
+			info = &s->frame_info[back];
+			info->width = emu->width;
+			info->height = emu->height;
+			info->finished = timing_monotonic();
+			memcpy(info->line_hash, emu->line_hash, emu->height * sizeof(uint32_t));
+			back = triple_buffer_publish(&s->frames);
+			session_wake(s);
+		}
+		
+		/* never blocks, the audio thread deals with the device, rewinding is silent */
+		phase_start = s->frame_phases ? timing_now() : 0;
+		if (!rewound)
+		{
+			audio_queue(&s->output, emu->samples, emu->audio_bytes);
+		}
+		emu->audio_bytes = 0;
+		if (s->frame_phases)
+		{
+			record_emulator_phases(s->frame_phases, emu, phase_start);
+			phases_add(s->frame_phases, PHASE_AUDIO, timing_now() - phase_start, phase_start);
+		}
+		
+		TRACE_END("frame");
+		if (s->frame_bench)
+		{
+			bench_add(s->frame_bench, timing_now() - start);
+		}
+		if (s->frame_limit > 0 && ++frame >= s->frame_limit)
+		{
 			break;
+		}
+		phase_start = s->frame_phases ? timing_now() : 0;
+		if (s->audio_sync && !fast_forward)
+		{
+			emu->resample_ratio = audio_sync(&s->output);
+		}
+		else
+		{
+			if (s->display_sync && !fast_forward)
+			{
+				/* let the display's vblanks set the phase of the schedule, once it has reported them */
+				vblank = atomic_get(&s->disp->vblank_ns);
+				refresh = atomic_get(&s->disp->refresh_ns);
+				if (vblank != 0 && refresh != 0 && !pacer_lock(&s->frame_pacer, vblank, refresh) && !s->display_mismatch)
+				{
+					warn("display refreshes at %.3f Hz, too far from the game's rate to sync to, falling back to video sync\n", (double) BILLION / refresh);
+					s->display_mismatch = cc_true;
+				}
+			}
+			if (!fast_forward)
+			{
+				/* the pacer's clock isn't the audio device's, so resample to keep the audio level steady */
+				emu->resample_ratio = audio_rate_control(&s->output);
+			}
+			/* fast-forward runs the pacer flat out, which would swamp the jitter measurements */
+			pacer_wait(&s->frame_pacer, (frameskip ? PACER_KEEP_SCHEDULE : 0) | (fast_forward ? PACER_UNTIMED : 0));
+		}
+		if (s->frame_phases)
+		{
+			phases_add(s->frame_phases, PHASE_SLEEP, timing_now() - phase_start, phase_start);
+		}
+	}
+	if (s->frame_bench)
+	{
+		bench_end(s->frame_bench);
 	}
+	if (s->frame_perf)
+	{
+		/* the totals stay behind for the report */
+		perf_close(s->frame_perf);
+	}
+	atomic_set(&s->finished, 1);
+	session_wake(s);
+	return NULL;
 }
 
 /* init and main loop */
 int main(int argc, char ** argv)
 {
 	int ret;
-	long ns_desired;
+	session sess;
+	pthread_t emu_thread;
+	long spin_us;
+	cc_bool jitter_enabled;
+	cc_bool phases_enabled;
+	cc_bool perf_enabled;
+	perf_counters frame_perf;
+	const char * phases_csv;
+	const char * trace_file;
+	long phases_interval;
+	phases * frame_phases;
+	uint64_t phase_start;
+	int events;
+	long audio_depth_ms;
+	cc_bool audio_stats_enabled;
+	cc_bool audio_sync_enabled;
+	cc_bool display_sync_enabled;
+	long runahead;
+	long rewind_mb;
+	long rewind_interval;
+	rewind_buffer history;
+	savestate_writer states;
+	state_slots slots;
+	long state_slots_count;
+	cc_bool memory_states;
+	char * state_path;
+	cc_bool fast_forward;
+	cc_bool fast_forward_held;
+	long fast_forward_speed;
+	long frameskip;
 	
 	emulator * emu;
 	
@@ -129,30 +619,23 @@ int main(int argc, char ** argv)
 	const char * state_file;
 	int i;
 	int running;
+	cc_bool headless;
+	cc_bool bench_enabled;
+	cc_bool convert_bench_enabled;
+	cc_bool indexed;
+	cc_bool pipelined;
+	long depth;
+	long scale;
+	cc_bool fullscreen;
+	cc_bool present;
+	const char * convert_kernel;
+	long frames;
+	bench frame_bench;
+	int fresh;
+	int front;
+	frame_info * info;
 	
-	int root;
-	int default_screen;
-	int bit_depth;
-	XVisualInfo vis_info;
-	XSetWindowAttributes window_attr;
-	unsigned long attr_mask;
-	Window window;
-	Atom wm_delete_window;
-	Display * display;
-	XImage * x_window_buffer;
-	GC default_gc;
-	XSizeHints hints;
-#ifndef DISABLE_AUDIO
-#if defined(__linux__)
-	pa_simple * audio_device;
-	pa_sample_spec audio_params;
-	int audio_error;
-#elif defined(__OpenBSD__)
-	struct sio_hdl * audio_device;
-	struct sio_par audio_params;
-	cc_bool audio_init;
-#endif
-#endif
+	display disp;
 	ret = 1;
 	
 	if (argc < 2)
@@ -168,6 +651,40 @@ int main(int argc, char ** argv)
 	cartridge_file = NULL;
 	cd_file = NULL;
 	state_file = NULL;
+	headless = cc_false;
+	bench_enabled = cc_false;
+	convert_bench_enabled = cc_false;
+	indexed = cc_false;
+	pipelined = cc_false;
+	depth = 0;
+	scale = 0;
+	fullscreen = cc_false;
+	present = cc_false;
+	frames = 0;
+	spin_us = 0;
+	jitter_enabled = cc_false;
+	phases_enabled = cc_false;
+	perf_enabled = cc_false;
+	phases_csv = NULL;
+	trace_file = NULL;
+	phases_interval = 5;
+	frame_phases = NULL;
+	audio_depth_ms = AUDIO_DEFAULT_DEPTH_MS;
+	audio_stats_enabled = cc_false;
+	audio_sync_enabled = cc_false;
+	display_sync_enabled = cc_false;
+	runahead = 0;
+	rewind_mb = 0;
+	rewind_interval = 1;
+	fast_forward = cc_false;
+	fast_forward_speed = 0;
+	frameskip = 0;
+	memset(&frame_bench, 0, sizeof(frame_bench));
+	memset(&history, 0, sizeof(history));
+	memset(&states, 0, sizeof(states));
+	memset(&slots, 0, sizeof(slots));
+	state_slots_count = SLOTS_MAX;
+	memory_states = cc_false;
 	
 	/*
 	 * parse args
@@ -293,6 +810,302 @@ int main(int argc, char ** argv)
 						}
 					}
 					break;
+				case '-':
+					/* long options */
+					if (strcmp(argv[i], "--headless") == 0)
+					{
+						headless = cc_true;
+					}
+					else if (strcmp(argv[i], "--bench") == 0)
+					{
+						bench_enabled = cc_true;
+					}
+					else if (strcmp(argv[i], "--scale") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("scale not specified\n");
+							return ret;
+						}
+						i++;
+						scale = strtol(argv[i], NULL, 10);
+						if (scale < 1 || scale > DISPLAY_SCALE_MAX)
+						{
+							printf("scale must be between 1 and %d\n", DISPLAY_SCALE_MAX);
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--fullscreen") == 0)
+					{
+						fullscreen = cc_true;
+					}
+					else if (strcmp(argv[i], "--present") == 0)
+					{
+#ifdef ENABLE_PRESENT
+						present = cc_true;
+#else
+						printf("built without Present extension support, rebuild with ENABLE_PRESENT=1\n");
+						return ret;
+#endif
+					}
+					else if (strcmp(argv[i], "--depth") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("visual depth not specified\n");
+							return ret;
+						}
+						i++;
+						depth = strtol(argv[i], NULL, 10);
+						if (depth != 15 && depth != 16 && depth != 24 && depth != 32)
+						{
+							printf("visual depth must be 15, 16, 24 or 32\n");
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--indexed") == 0)
+					{
+						indexed = cc_true;
+					}
+					else if (strcmp(argv[i], "--pipeline") == 0)
+					{
+						pipelined = cc_true;
+					}
+					else if (strcmp(argv[i], "--bench-convert") == 0)
+					{
+						convert_bench_enabled = cc_true;
+					}
+					else if (strcmp(argv[i], "--frames") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("frame count not specified\n");
+							return ret;
+						}
+						i++;
+						frames = strtol(argv[i], NULL, 10);
+						if (frames <= 0)
+						{
+							printf("frame count must be a positive number\n");
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--spin") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("spin time not specified\n");
+							return ret;
+						}
+						i++;
+						spin_us = strtol(argv[i], NULL, 10);
+						if (spin_us < 0 || spin_us > 1000000)
+						{
+							printf("spin time must be between 0 and 1000000 microseconds\n");
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--jitter") == 0)
+					{
+						jitter_enabled = cc_true;
+					}
+					else if (strcmp(argv[i], "--phases") == 0)
+					{
+						phases_enabled = cc_true;
+					}
+					else if (strcmp(argv[i], "--phases-csv") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("phase csv file not specified\n");
+							return ret;
+						}
+						phases_csv = argv[++i];
+						phases_enabled = cc_true;
+					}
+					else if (strcmp(argv[i], "--perf") == 0)
+					{
+						perf_enabled = cc_true;
+					}
+					else if (strcmp(argv[i], "--trace") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("trace file not specified\n");
+							return ret;
+						}
+						trace_file = argv[++i];
+					}
+					else if (strcmp(argv[i], "--phases-interval") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("phase csv interval not specified\n");
+							return ret;
+						}
+						i++;
+						phases_interval = strtol(argv[i], NULL, 10);
+						if (phases_interval < 1 || phases_interval > 3600)
+						{
+							printf("phase csv interval must be between 1 and 3600 seconds\n");
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--audio-depth") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("audio depth not specified\n");
+							return ret;
+						}
+						i++;
+						audio_depth_ms = strtol(argv[i], NULL, 10);
+						if (audio_depth_ms < 10 || audio_depth_ms > 1000)
+						{
+							printf("audio depth must be between 10 and 1000 milliseconds\n");
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--audio-stats") == 0)
+					{
+						audio_stats_enabled = cc_true;
+					}
+					else if (strcmp(argv[i], "--run-ahead") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("run-ahead frame count not specified\n");
+							return ret;
+						}
+						i++;
+						runahead = strtol(argv[i], NULL, 10);
+						if (runahead < 0 || runahead > RUNAHEAD_MAX)
+						{
+							printf("run-ahead frame count must be between 0 and %d\n", RUNAHEAD_MAX);
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--rewind") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("rewind budget not specified\n");
+							return ret;
+						}
+						i++;
+						rewind_mb = strtol(argv[i], NULL, 10);
+						if (rewind_mb < 1 || rewind_mb > 4096)
+						{
+							printf("rewind budget must be between 1 and 4096 megabytes\n");
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--rewind-interval") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("rewind interval not specified\n");
+							return ret;
+						}
+						i++;
+						rewind_interval = strtol(argv[i], NULL, 10);
+						if (rewind_interval < 1 || rewind_interval > 600)
+						{
+							printf("rewind interval must be between 1 and 600 frames\n");
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--state-slots") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("save state slot count not specified\n");
+							return ret;
+						}
+						i++;
+						state_slots_count = strtol(argv[i], NULL, 10);
+						if (state_slots_count < 1 || state_slots_count > SLOTS_MAX)
+						{
+							printf("save state slot count must be between 1 and %d\n", SLOTS_MAX);
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--memory-states") == 0)
+					{
+						memory_states = cc_true;
+					}
+					else if (strcmp(argv[i], "--frameskip") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("frameskip limit not specified\n");
+							return ret;
+						}
+						i++;
+						frameskip = strtol(argv[i], NULL, 10);
+						if (frameskip < 1 || frameskip > FRAMESKIP_MAX)
+						{
+							printf("frameskip limit must be between 1 and %d\n", FRAMESKIP_MAX);
+							return ret;
+						}
+					}
+					else if (strcmp(argv[i], "--fast-forward") == 0)
+					{
+						fast_forward = cc_true;
+					}
+					else if (strcmp(argv[i], "--fast-forward-speed") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("fast-forward speed not specified\n");
+							return ret;
+						}
+						i++;
+						if (strcmp(argv[i], "max") == 0)
+						{
+							fast_forward_speed = 0;
+						}
+						else
+						{
+							fast_forward_speed = strtol(argv[i], NULL, 10);
+							if (fast_forward_speed < 2 || fast_forward_speed > 100)
+							{
+								printf("fast-forward speed must be max or between 2 and 100\n");
+								return ret;
+							}
+						}
+					}
+					else if (strcmp(argv[i], "--sync") == 0)
+					{
+						if (i == argc - 1)
+						{
+							printf("sync mode not specified\n");
+							return ret;
+						}
+						i++;
+						audio_sync_enabled = cc_false;
+						display_sync_enabled = cc_false;
+						if (strcmp(argv[i], "audio") == 0)
+						{
+							audio_sync_enabled = cc_true;
+						}
+						else if (strcmp(argv[i], "display") == 0)
+						{
+							display_sync_enabled = cc_true;
+						}
+						else if (strcmp(argv[i], "video") != 0)
+						{
+							printf("sync mode must be video, audio or display\n");
+							return ret;
+						}
+					}
+					else
+					{
+						printf("unknown flag %s\n", argv[i]);
+						usage(argv[0]);
+						return ret;
+					}
+					break;
 				default:
 					printf("unknown flag %s\n", argv[i]);
 					usage(argv[0]);
@@ -314,6 +1127,12 @@ int main(int argc, char ** argv)
 		}
 	}
 	
+	if (convert_bench_enabled)
+	{
+		convert_benchmark();
+		return 0;
+	}
+	
 	if (!filename && !cartridge_file && !cd_file)
 	{
 		printf("no bootable media filename specified\n");
@@ -328,79 +1147,53 @@ int main(int argc, char ** argv)
 	width = widescreen_enabled == cc_true ? VDP_MAX_SCANLINE_WIDTH : VDP_H40_SCREEN_WIDTH_IN_TILE_PAIRS * VDP_TILE_PAIR_WIDTH;
 	height = VDP_MAX_SCANLINES;
 	
+	if (trace_file)
+	{
+		if (!trace_init(trace_file))
+		{
+			return ret;
+		}
+		trace_thread_name("main");
+	}
+	
+	/* from here on, logging from inside the core never waits on the terminal */
+	logger_init();
+	
 	emu = (emulator *) malloc(sizeof(emulator));
 	if (!emu)
 	{
 		printf("unable to alloc emu\n");
+		logger_shutdown();
+		trace_shutdown();
 		return ret;
 	}
 	memset(emu, 0, sizeof(emulator));
 	
-	emu->framebuffer = (uint32_t *) malloc(FRAMEBUFFER_SIZE);
-	if (!emu->framebuffer)
+	/* init emu */
+	ClownMDEmu_Constant_Initialise();
+	convert_kernel = convert_init();
+	emulator_init(emu);
+	emulator_set_options(emu, log_enabled, widescreen_enabled);
+	emulator_set_runahead(emu, runahead);
+	if (!emulator_set_indexed(emu, indexed))
 	{
-		printf("unable to alloc internal framebuffer\n");
 		goto cleanup_emu;
 	}
-	
-	/* init window */
-	bit_depth = 24;
-	attr_mask = CWBackPixel | CWColormap | CWEventMask;
-	display = XOpenDisplay(0);
-	if (!display)
+	if (pipelined && indexed)
 	{
-		printf("unable to open display\n");
+		printf("--pipeline can't be combined with --indexed, which doesn't convert while emulating\n");
 		goto cleanup_emu;
 	}
-	root = DefaultRootWindow(display);
-	default_screen = DefaultScreen(display);
-	if (!XMatchVisualInfo(display, default_screen, bit_depth, TrueColor, &vis_info))
+	if (!emulator_set_pipelined(emu, pipelined))
 	{
-		printf("no matching visual info\n");
-		goto cleanup_x11_display;
-	}
-	window_attr.background_pixel = 0;
-	window_attr.colormap = XCreateColormap(display, root, vis_info.visual, AllocNone);
-	window_attr.event_mask = KeyPressMask | KeyReleaseMask;
-	window = XCreateWindow(display, root, 0, 0, width, height, 0, vis_info.depth, InputOutput, vis_info.visual, attr_mask, &window_attr);
-	if (!window)
-	{
-		printf("unable to create window\n");
-		goto cleanup_x11_display;
-	}
-	XStoreName(display, window, "clownmdemu");
-	hints.flags = PMinSize | PMaxSize;
-	hints.min_width = width;
-	hints.min_height = height;
-	hints.max_width = width;
-	hints.max_height = height;
-	XSetWMNormalHints(display, window, &hints);
-	XMapWindow(display, window);
-	XFlush(display);
-	x_window_buffer = XCreateImage(display, vis_info.visual, vis_info.depth, ZPixmap, 0, (char *) emu->framebuffer, width, height, 32, 0);
-	if (!x_window_buffer)
-	{
-		printf("unable to create window image\n");
-		goto cleanup_x11_display;
-	}
-	default_gc = DefaultGC(display, default_screen);
-	wm_delete_window = XInternAtom(display, "WM_DELETE_WINDOW", False);
-	if (!XSetWMProtocols(display, window, &wm_delete_window, 1))
-	{
-		printf("unable to intercept window close event\n");
-		goto cleanup_x11_window;
+		goto cleanup_emu;
 	}
-	
-	/* init emu */
-	ClownMDEmu_Constant_Initialise();
-	emulator_init(emu);
-	emulator_set_options(emu, log_enabled, widescreen_enabled);
 	if (cartridge_file)
 	{
 		if (!emulator_load_cartridge(emu, cartridge_file))
 		{
 			printf("unable to load cartridge\n");
-			goto cleanup_x11_window;
+			goto cleanup_emu;
 		}
 	}
 	if (cd_file)
@@ -408,7 +1201,7 @@ int main(int argc, char ** argv)
 		if (!emulator_load_cd(emu, cd_file))
 		{
 			printf("unable to load cd\n");
-			goto cleanup_x11_window;
+			goto cleanup_emu;
 		}
 	}
 	if (!cartridge_file && !cd_file)
@@ -416,191 +1209,372 @@ int main(int argc, char ** argv)
 		if (!emulator_load_file(emu, filename))
 		{
 			printf("unable to load file\n");
-			goto cleanup_x11_window;
+			goto cleanup_emu;
 		}
 	}
 	emulator_set_region(emu, region);
 	emulator_init_audio(emu);
+	emulator_reset(emu, cc_true);
+	if (state_file)
+	{
+		TRACE_BEGIN("load_state");
+		emulator_load_state(emu, state_file);
+		TRACE_END("load_state");
+	}
 	
-#ifndef DISABLE_AUDIO
-	/* init audio */
-#if defined(__linux__)
-	audio_params.format = PA_SAMPLE_S16LE;
-	audio_params.channels = MIXER_CHANNEL_COUNT;
-	audio_params.rate = emu->clownmdemu.configuration.tv_standard == CLOWNMDEMU_TV_STANDARD_PAL ? MIXER_OUTPUT_SAMPLE_RATE_PAL : MIXER_OUTPUT_SAMPLE_RATE_NTSC;
-	audio_device = pa_simple_new(NULL, argv[0], PA_STREAM_PLAYBACK, NULL, "audio", &audio_params, NULL, NULL, &audio_error);
-	if (!audio_device)
+	if (bench_enabled && !bench_init(&frame_bench, frames))
+	{
+		printf("unable to alloc benchmark buffer\n");
+		goto cleanup_emu;
+	}
+	
+	if (phases_enabled)
+	{
+		frame_phases = (phases *) malloc(sizeof(phases));
+		if (!frame_phases)
+		{
+			printf("unable to alloc phase histograms\n");
+			goto cleanup_emu;
+		}
+		if (!phases_init(frame_phases, phases_csv, phases_interval))
+		{
+			free(frame_phases);
+			frame_phases = NULL;
+			goto cleanup_emu;
+		}
+		emu->timed = cc_true;
+	}
+	
+	if (rewind_mb > 0 && !rewind_init(&history, (size_t) rewind_mb * 1024 * 1024, rewind_interval))
+	{
+		printf("unable to init rewind\n");
+		goto cleanup_emu;
+	}
+	
+	if (headless)
+	{
+		/* nothing looks at headless frames, so indexed mode never needs pixels at all */
+		emu->framebuffer = indexed ? NULL : malloc(FRAMEBUFFER_SIZE);
+		if (!indexed && !emu->framebuffer)
+		{
+			printf("unable to alloc internal framebuffer\n");
+			goto cleanup_emu;
+		}
+		run_headless(emu, frames, bench_enabled ? &frame_bench : NULL, history.init ? &history : NULL, frame_phases, perf_enabled ? &frame_perf : NULL);
+		if (bench_enabled)
+		{
+			rewind_report(&history, bench_mean(&frame_bench));
+			bench_report(&frame_bench);
+			printf("bench: %s scanline conversion, %u bytes per pixel\n", convert_kernel, convert_pixel_bytes);
+			if (emu->pipelined && frame_bench.count > 0)
+			{
+				printf("bench: waited %.3f ms per frame for the conversion worker\n", (double) emu->pipeline_wait_ns / frame_bench.count / 1000000.0);
+			}
+		}
+		if (perf_enabled)
+		{
+			perf_report(&frame_perf);
+		}
+		if (frame_phases)
+		{
+			phases_report(frame_phases);
+		}
+#ifdef PROFILE_CALLBACKS
+		profile_report();
+#endif
+		ret = 0;
+		goto cleanup_emu;
+	}
+	
+	/* init window */
+	if (display_sync_enabled && !present)
+	{
+		printf("display sync needs --present\n");
+		goto cleanup_emu;
+	}
+	if (!display_init(&disp, width, height, depth, scale, fullscreen, present))
+	{
+		goto cleanup_emu;
+	}
+	/* otherwise a held key repeats as release and press pairs, and only the presses can be told apart */
+	XkbSetDetectableAutoRepeat(disp.x_display, True, NULL);
+	if (display_sync_enabled && !disp.use_present)
 	{
-		warn("unable to create audio device: %s\n", pa_strerror(audio_error));
+		warn("no vblank timing to sync to, falling back to video sync\n");
+		display_sync_enabled = cc_false;
 	}
-#elif defined(__OpenBSD__)
-	audio_init = cc_false;
-	audio_device = sio_open(SIO_DEVANY, SIO_PLAY, 0);
-	if (!audio_device)
+	if (!emulator_set_scale(emu, disp.scale))
 	{
-		warn("unable to open audio device\n");
-		goto skip_audio_init;
+		goto cleanup_display;
 	}
-	sio_initpar(&audio_params);
-	audio_params.bits = 16;
-	audio_params.bps = SIO_BPS(16);
-	audio_params.le = SIO_LE_NATIVE;
-	audio_params.pchan = MIXER_CHANNEL_COUNT;
-	audio_params.rate = emu->clownmdemu.configuration.tv_standard == CLOWNMDEMU_TV_STANDARD_PAL ? MIXER_OUTPUT_SAMPLE_RATE_PAL : MIXER_OUTPUT_SAMPLE_RATE_NTSC;
-	audio_params.xrun = SIO_IGNORE;
-	if (!sio_setpar(audio_device, &audio_params))
+	/* draw straight in the window's pixel format, so 16-bit visuals move half the bytes */
+	convert_kernel = convert_set_format(disp.bytes_per_pixel, disp.vis_info.red_mask, disp.vis_info.green_mask, disp.vis_info.blue_mask);
+	emulator_refresh_palette(emu);
+	
+	memset(&sess, 0, sizeof(sess));
+	sess.emu = emu;
+	sess.disp = &disp;
+	sess.frame_bench = bench_enabled ? &frame_bench : NULL;
+	sess.frame_phases = frame_phases;
+	sess.frame_perf = perf_enabled ? &frame_perf : NULL;
+	sess.frame_limit = frames;
+	sess.history = history.init ? &history : NULL;
+	/* slots that can't be written out are still worth having in memory */
+	state_path = memory_states ? NULL : emulator_state_path(emu);
+	if (state_path && !savestate_init(&states))
 	{
-		warn("unable to set audio properties\n");
-		goto skip_audio_init;
+		warn("save state slots will be kept in memory only\n");
 	}
-	if (!sio_start(audio_device))
+	sess.slots = slots_init(&slots, state_slots_count, states.init ? &states : NULL, state_path) ? &slots : NULL;
+	free(state_path);
+	sess.fast_forward = fast_forward;
+	sess.fast_forward_speed = fast_forward_speed;
+	sess.frameskip_max = frameskip;
+	triple_buffer_init(&sess.frames);
+	if (pipe(sess.wake_pipe) != 0)
 	{
-		warn("unable to start audio device\n");
+		printf("unable to create wakeup pipe\n");
+		goto cleanup_display;
+	}
+	fcntl(sess.wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(sess.wake_pipe[1], F_SETFL, O_NONBLOCK);
+	
+	/* init audio */
+	if (!audio_init(&sess.output, argv[0], emu->clownmdemu.configuration.tv_standard == CLOWNMDEMU_TV_STANDARD_PAL ? MIXER_OUTPUT_SAMPLE_RATE_PAL : MIXER_OUTPUT_SAMPLE_RATE_NTSC, MIXER_CHANNEL_COUNT, audio_depth_ms) && audio_sync_enabled)
+	{
+		warn("no audio output to sync to, falling back to video sync\n");
+		audio_sync_enabled = cc_false;
+	}
+	sess.audio_sync = audio_sync_enabled;
+	sess.display_sync = display_sync_enabled;
+	
+	if (emu->clownmdemu.configuration.tv_standard == CLOWNMDEMU_TV_STANDARD_NTSC)
+	{
+		pacer_init(&sess.frame_pacer, (uint64_t) BILLION * MASTER_CYCLES_PER_SCANLINE * SCANLINES_PER_FRAME_NTSC, MASTER_CLOCK_NTSC, spin_us * 1000);
 	}
 	else
 	{
-		audio_init = cc_true;
+		pacer_init(&sess.frame_pacer, (uint64_t) BILLION * MASTER_CYCLES_PER_SCANLINE * SCANLINES_PER_FRAME_PAL, MASTER_CLOCK_PAL, spin_us * 1000);
 	}
-skip_audio_init:
-#endif
-#endif
 	
-	emulator_reset(emu, cc_true);
-	if (state_file)
+	if (pthread_create(&emu_thread, NULL, emulation_thread, &sess) != 0)
 	{
-		emulator_load_state(emu, state_file);
+		printf("unable to start emulation thread\n");
+		goto cleanup_audio;
 	}
 	
-	ns_desired = BILLION / (emu->clownmdemu.configuration.tv_standard == CLOWNMDEMU_TV_STANDARD_NTSC ? 60.0f : 50.0f);
 	running = 1;
-	/* main loop */
+	fast_forward_held = cc_false;
+	/* presentation loop, the emulation thread does the rest */
 	while (running)
 	{
-		static long ns_elapsed, ns_delta;
-		static struct timespec start_timespec, end_timespec, sleep_timespec;
+		struct pollfd fds[2];
+		char drain[64];
 		XEvent ev;
 		
-		ns_elapsed = ns_delta = 0;
-		sleep_timespec.tv_sec = sleep_timespec.tv_nsec = 0;
-		clock_gettime(CLOCK_MONOTONIC_RAW, &start_timespec);
-		
-		while (XPending(display) > 0)
+		phase_start = frame_phases ? timing_now() : 0;
+		events = 0;
+		while (XPending(disp.x_display) > 0)
 		{
 			XClientMessageEvent * ec;
 			XKeyPressedEvent * ek;
 			int keysym;
 			
-			XNextEvent(display, &ev);
+			XNextEvent(disp.x_display, &ev);
+			events++;
+			if (display_handle_event(&disp, &ev))
+			{
+				continue;
+			}
 			switch (ev.type)
 			{
 				case ClientMessage:
 					ec = (XClientMessageEvent *) &ev;
-					if ((Atom) ec->data.l[0] == wm_delete_window)
+					if ((Atom) ec->data.l[0] == disp.wm_delete_window)
 					{
 						running = 0;
 					}
 					break;
 				case KeyPress:
 					ek = (XKeyPressedEvent *) &ev;
-					keysym = XkbKeycodeToKeysym(display, ek->keycode, 0, 0);
+					keysym = XkbKeycodeToKeysym(disp.x_display, ek->keycode, 0, 0);
 					switch (keysym)
 					{
 						case XK_Escape:
 							running = 0;
 							break;
 						case XK_Tab:
-							emulator_reset(emu, cc_false);
+							atomic_or(&sess.commands, COMMAND_RESET);
+							break;
+						case XK_BackSpace:
+							atomic_set(&sess.rewinding, 1);
+							break;
+						case XK_space:
+							/* toggle once per press, not on every autorepeat */
+							if (!fast_forward_held)
+							{
+								atomic_set(&sess.fast_forward, !atomic_get(&sess.fast_forward));
+							}
+							fast_forward_held = cc_true;
 							break;
 						default:
-							toggle_key(emu, keysym, cc_true);
+							if (keysym >= XK_0 && keysym <= XK_9)
+							{
+								select_slot(&sess, (unsigned int) (keysym - XK_0));
+							}
+							else
+							{
+								toggle_key(&sess, keysym, cc_true);
+							}
 							break;
 					}
 					break;
 				case KeyRelease:
 					ek = (XKeyPressedEvent *) &ev;
-					keysym = XkbKeycodeToKeysym(display, ek->keycode, 0, 0);
+					keysym = XkbKeycodeToKeysym(disp.x_display, ek->keycode, 0, 0);
 					switch (keysym)
 					{
 						case XK_F5:
-							emulator_save_state(emu);
+							atomic_or(&sess.commands, COMMAND_SAVE_STATE);
 							break;
 						case XK_F8:
-							emulator_load_state(emu, NULL);
+							atomic_or(&sess.commands, COMMAND_LOAD_STATE);
+							break;
+						case XK_BackSpace:
+							atomic_set(&sess.rewinding, 0);
+							break;
+						case XK_space:
+							fast_forward_held = cc_false;
 							break;
 						default:
-							toggle_key(emu, keysym, cc_false);
+							toggle_key(&sess, keysym, cc_false);
 							break;
 					}
 					break;
 			}
 		}
 		
-		memset(emu->framebuffer, 0, FRAMEBUFFER_SIZE);
-		
-		emulator_iterate(emu);
+		if (frame_phases && events > 0)
+		{
+			phases_add(frame_phases, PHASE_EVENTS, timing_now() - phase_start, phase_start);
+		}
 		
-		if (emu->width > 0 && emu->height > 0)
+		/* the front buffer can't be given back to the emulation thread while the server is reading it */
+		if (!display_is_busy(&disp, sess.frames.front))
 		{
-			if (emu->width != x_window_buffer->width || emu->height != x_window_buffer->height)
+			front = triple_buffer_acquire(&sess.frames, &fresh);
+			/* repeated frames aren't published, so an exposed window is redrawn from the frame it last showed */
+			if (fresh || (display_needs_redraw(&disp) && sess.frame_info[front].width > 0))
 			{
-				XClearWindow(display, window);
+				info = &sess.frame_info[front];
+				phase_start = frame_phases ? timing_now() : 0;
+				TRACE_BEGIN("present");
+				display_present(&disp, front, info->width, info->height, info->line_hash, info->finished);
+				TRACE_END("present");
+				if (frame_phases)
+				{
+					phases_add(frame_phases, PHASE_UPLOAD, timing_now() - phase_start, phase_start);
+				}
 			}
-			x_window_buffer->width = emu->width;
-			x_window_buffer->height = emu->height;
-			x_window_buffer->bytes_per_line = emu->width * 4;
-			XPutImage(display, window, default_gc, x_window_buffer, 0, 0, (width - emu->width) / 2, (height - emu->height) / 2, width, height);
 		}
 		
-#ifndef DISABLE_AUDIO
-#if defined(__linux__)
-		if (audio_device)
+		if (atomic_get(&sess.finished))
 		{
-			pa_simple_write(audio_device, emu->samples, emu->audio_bytes, &audio_error);
+			running = 0;
 		}
-#elif defined(__OpenBSD__)
-		if (audio_init)
+		if (!running)
 		{
-			sio_write(audio_device, emu->samples, emu->audio_bytes);
+			break;
 		}
-#endif
-#endif
 		
-		clock_gettime(CLOCK_MONOTONIC_RAW, &end_timespec);
-		if (end_timespec.tv_sec - start_timespec.tv_sec == 0)
+		/* sleep until there's either a new frame or an x event */
+		fds[0].fd = ConnectionNumber(disp.x_display);
+		fds[0].events = POLLIN;
+		fds[1].fd = sess.wake_pipe[0];
+		fds[1].events = POLLIN;
+		poll(fds, 2, -1);
+		if (fds[1].revents & POLLIN)
 		{
-			ns_elapsed = end_timespec.tv_nsec - start_timespec.tv_nsec;
-			ns_delta = ns_desired - ns_elapsed;
-			/*printf("%ld %ld\n", ns_elapsed, ns_delta);*/
-			if (ns_elapsed < ns_desired)
+			while (read(sess.wake_pipe[0], drain, sizeof(drain)) > 0)
 			{
-				sleep_timespec.tv_nsec = ns_delta;
-				nanosleep(&sleep_timespec, NULL);
 			}
 		}
 	}
-	ret = 0;
-#ifndef DISABLE_AUDIO
-#if defined(__linux__)
-	if (audio_device)
+	atomic_set(&sess.quit, 1);
+	pthread_join(emu_thread, NULL);
+	if (bench_enabled)
 	{
-		pa_simple_drain(audio_device, &audio_error);
-		pa_simple_free(audio_device);
+		rewind_report(&history, bench_mean(&frame_bench));
+		bench_report(&frame_bench);
+		printf("bench: %s scanline conversion, %u bytes per pixel\n", convert_kernel, convert_pixel_bytes);
+		if (emu->pipelined && frame_bench.count > 0)
+		{
+			printf("bench: waited %.3f ms per frame for the conversion worker\n", (double) emu->pipeline_wait_ns / frame_bench.count / 1000000.0);
+		}
+		if (disp.scale > 1 && frame_bench.count > 0)
+		{
+			printf("bench: %dx scaling %.3f ms per frame\n", disp.scale, (double) emu->scale_ns / frame_bench.count / 1000000.0);
+		}
+		if (sess.fast_forward_frames > 0)
+		{
+			printf("bench: %lu more frames emulated while fast-forwarding\n", sess.fast_forward_frames);
+		}
+		printf("bench: %lu repeated frames not converted or uploaded\n", sess.frames_duplicate);
 	}
-#elif defined(__OpenBSD__)
-	if (audio_init)
+	if (perf_enabled)
 	{
-		sio_stop(audio_device);
-		sio_close(audio_device);
+		perf_report(&frame_perf);
 	}
+	if (jitter_enabled)
+	{
+		pacer_report(&sess.frame_pacer);
+		display_report(&disp);
+	}
+	if (frame_phases)
+	{
+		phases_report(frame_phases);
+	}
+#ifdef PROFILE_CALLBACKS
+	profile_report();
 #endif
-#endif
-cleanup_x11_window:
-	XDestroyWindow(display, window);
-	XDestroyImage(x_window_buffer);
-cleanup_x11_display:
-	XCloseDisplay(display);
+	if (frameskip > 0)
+	{
+		printf("frameskip: %lu of %lu frames skipped (%.1f%%), longest run %u\n",
+			sess.frames_skipped,
+			sess.frames_shown + sess.frames_skipped,
+			sess.frames_shown + sess.frames_skipped > 0 ? sess.frames_skipped * 100.0 / (sess.frames_shown + sess.frames_skipped) : 0.0,
+			sess.frameskip_longest
+		);
+	}
+	if (audio_stats_enabled)
+	{
+		audio_report(&sess.output);
+	}
+	ret = 0;
+cleanup_audio:
+	audio_shutdown(&sess.output);
+	close(sess.wake_pipe[0]);
+	close(sess.wake_pipe[1]);
+cleanup_display:
+	/* the framebuffer belongs to the display */
+	emu->framebuffer = NULL;
+	display_shutdown(&disp);
 cleanup_emu:
+	rewind_shutdown(&history);
+	/* slots not written out yet are handed to the writer, which finishes them before stopping */
+	slots_shutdown(&slots);
+	savestate_shutdown(&states);
+	bench_free(&frame_bench);
+	if (frame_phases)
+	{
+		phases_shutdown(frame_phases);
+		free(frame_phases);
+	}
+	free(emu->framebuffer);
 	emulator_shutdown(emu);
 	free(emu);
+	/* last, so every thread that logs or records events has been joined */
+	logger_shutdown();
+	trace_shutdown();
 	return ret;
 }
@@ -0,0 +1,233 @@
+#include "perf.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+typedef struct perf_event
+{
+	uint32_t type;
+	uint64_t config;
+	const char * name;
+} perf_event;
+
+/* the first of each set leads the group, the others are only counted while it is */
+static const perf_event perf_hardware[PERF_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses" }
+};
+
+static const perf_event perf_software[PERF_COUNTERS] = {
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock-ns" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "cpu-migrations" }
+};
+
+static int perf_open_event(const perf_event * ev, int group)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = ev->type;
+	attr.config = ev->config;
+	attr.disabled = group < 0;
+	attr.exclude_kernel = 1; /* all that's allowed without privileges, and the core never leaves user space anyway */
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static int perf_open_set(perf_counters * p, const perf_event * set)
+{
+	int i;
+	p->fds[0] = perf_open_event(&set[0], -1);
+	if (p->fds[0] < 0)
+	{
+		return 0;
+	}
+	for (i = 1; i < PERF_COUNTERS; i++)
+	{
+		/* some PMUs lack a counter or two, the rest are still worth having */
+		p->fds[i] = perf_open_event(&set[i], p->fds[0]);
+	}
+	for (i = 0; i < PERF_COUNTERS; i++)
+	{
+		if (p->fds[i] >= 0)
+		{
+			p->counted |= 1u << i;
+		}
+	}
+	return 1;
+}
+
+/* reads every counter in the group at once, so they all cover the same stretch of time */
+static int perf_read(perf_counters * p, uint64_t * values)
+{
+	uint64_t buf[1 + PERF_COUNTERS];
+	ssize_t bytes;
+	uint64_t n;
+	int i;
+	
+	if (p->fds[0] < 0)
+	{
+		return 0;
+	}
+	bytes = read(p->fds[0], buf, sizeof(buf));
+	if (bytes < (ssize_t) sizeof(uint64_t))
+	{
+		return 0;
+	}
+	/* the group only holds the counters that opened, in the order they did */
+	n = 1;
+	for (i = 0; i < PERF_COUNTERS; i++)
+	{
+		values[i] = 0;
+		if ((p->counted & (1u << i)) && n <= buf[0])
+		{
+			values[i] = buf[n++];
+		}
+	}
+	return 1;
+}
+
+static const perf_event * perf_events(perf_counters * p)
+{
+	return p->software ? perf_software : perf_hardware;
+}
+#endif
+
+int perf_open(perf_counters * p)
+{
+	int i;
+	memset(p, 0, sizeof(perf_counters));
+	for (i = 0; i < PERF_COUNTERS; i++)
+	{
+		p->fds[i] = -1;
+	}
+#ifdef __linux__
+	if (!perf_open_set(p, perf_hardware))
+	{
+		p->software = 1;
+		if (!perf_open_set(p, perf_software))
+		{
+			printf("perf: unable to open counters: %s (see /proc/sys/kernel/perf_event_paranoid)\n", strerror(errno));
+			return 0;
+		}
+		printf("perf: no hardware counters, falling back to software ones\n");
+	}
+	ioctl(p->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(p->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return 1;
+#else
+	printf("perf: counters are only supported on linux\n");
+	return 0;
+#endif
+}
+
+void perf_begin(perf_counters * p)
+{
+#ifdef __linux__
+	perf_read(p, p->start);
+#else
+	(void) p;
+#endif
+}
+
+void perf_end(perf_counters * p)
+{
+#ifdef __linux__
+	uint64_t now[PERF_COUNTERS];
+	uint64_t delta;
+	int i;
+	if (!perf_read(p, now))
+	{
+		return;
+	}
+	for (i = 0; i < PERF_COUNTERS; i++)
+	{
+		delta = now[i] - p->start[i];
+		p->totals[i] += delta;
+		if (delta > p->max[i])
+		{
+			p->max[i] = delta;
+		}
+	}
+	p->frames++;
+#else
+	(void) p;
+#endif
+}
+
+void perf_report(perf_counters * p)
+{
+#ifdef __linux__
+	const perf_event * events = perf_events(p);
+	double instructions;
+	int i;
+	
+	if (p->counted == 0)
+	{
+		return; /* perf_open() already said why */
+	}
+	if (p->frames == 0)
+	{
+		printf("perf: no frames measured\n");
+		return;
+	}
+	for (i = 0; i < PERF_COUNTERS; i++)
+	{
+		if (p->counted & (1u << i))
+		{
+			printf("perf: %-16s %.1f per frame, max %lu\n", events[i].name, (double) p->totals[i] / p->frames, (unsigned long) p->max[i]);
+		}
+	}
+	if (p->software)
+	{
+		return;
+	}
+	instructions = (double) p->totals[1];
+	if ((p->counted & (1u << 1)) && p->totals[0] > 0)
+	{
+		printf("perf: %.2f instructions per cycle\n", instructions / p->totals[0]);
+	}
+	if ((p->counted & (1u << 1)) && instructions > 0.0)
+	{
+		if (p->counted & (1u << 2))
+		{
+			printf("perf: %.3f cache misses per 1000 instructions\n", p->totals[2] * 1000.0 / instructions);
+		}
+		if (p->counted & (1u << 3))
+		{
+			printf("perf: %.3f branch misses per 1000 instructions\n", p->totals[3] * 1000.0 / instructions);
+		}
+	}
+#else
+	(void) p;
+#endif
+}
+
+void perf_close(perf_counters * p)
+{
+#ifdef __linux__
+	int i;
+	for (i = 0; i < PERF_COUNTERS; i++)
+	{
+		if (p->fds[i] >= 0)
+		{
+			close(p->fds[i]);
+			p->fds[i] = -1;
+		}
+	}
+#else
+	(void) p;
+#endif
+}
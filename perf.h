@@ -0,0 +1,42 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+#define PERF_COUNTERS 4
+
+/*
+ * per-frame cpu counters from perf_event_open (linux only), counting user space on the thread that opened them
+ * hardware counters are used where there's a PMU, otherwise software ones, such as in most virtual machines
+ */
+typedef struct perf_counters
+{
+	int fds[PERF_COUNTERS]; /* -1 for counters that aren't open */
+	unsigned int counted; /* bit per counter that opened, kept after perf_close() for the report */
+	int software; /* fell back to the software counters */
+	uint64_t start[PERF_COUNTERS];
+	uint64_t totals[PERF_COUNTERS];
+	uint64_t max[PERF_COUNTERS]; /* worst single frame */
+	uint64_t frames;
+} perf_counters;
+
+/*
+ * opens the counters for the calling thread, which must be the one that then calls perf_begin() and perf_end()
+ * returns true on success, otherwise false, having said why
+ */
+int perf_open(perf_counters * p);
+
+/*
+ * marks the start and end of the measured part of a frame
+ */
+void perf_begin(perf_counters * p);
+void perf_end(perf_counters * p);
+
+/*
+ * prints the per-frame counts, IPC and miss rates
+ */
+void perf_report(perf_counters * p);
+
+void perf_close(perf_counters * p);
+
+#endif /* PERF_H */
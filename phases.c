@@ -0,0 +1,114 @@
+#include "phases.h"
+#include "timing.h"
+
+#include <string.h>
+
+static const char * const phase_names[PHASE_COUNT] = {
+	"events",
+	"core",
+	"mix",
+	"convert",
+	"upload",
+	"audio",
+	"sleep"
+};
+
+int phases_init(phases * p, const char * csv_path, unsigned int period_s)
+{
+	int i;
+	memset(p, 0, sizeof(phases));
+	p->start = timing_now();
+	p->period = (uint64_t) period_s * BILLION;
+	for (i = 0; i < PHASE_COUNT; i++)
+	{
+		p->due[i] = p->start + p->period;
+	}
+	if (csv_path)
+	{
+		p->csv = fopen(csv_path, "w");
+		if (!p->csv)
+		{
+			printf("unable to open %s for writing\n", csv_path);
+			return 0;
+		}
+		fprintf(p->csv, "seconds,phase,count,min_us,mean_us,p50_us,p99_us,max_us\n");
+	}
+	return 1;
+}
+
+/* a whole row goes out in one call, so rows from different threads never interleave */
+static void phases_write_row(phases * p, phase ph, uint64_t now)
+{
+	histogram * h = &p->interval[ph];
+	fprintf(p->csv, "%.3f,%s,%lu,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+		(double) (now - p->start) / BILLION,
+		phase_names[ph],
+		(unsigned long) h->count,
+		h->min / 1000.0,
+		histogram_mean(h) / 1000.0,
+		histogram_percentile(h, 50.0) / 1000.0,
+		histogram_percentile(h, 99.0) / 1000.0,
+		h->max / 1000.0
+	);
+}
+
+void phases_add(phases * p, phase ph, uint64_t ns, uint64_t now)
+{
+	histogram_add(&p->total[ph], ns);
+	if (!p->csv)
+	{
+		return;
+	}
+	histogram_add(&p->interval[ph], ns);
+	if (now >= p->due[ph])
+	{
+		phases_write_row(p, ph, now);
+		histogram_reset(&p->interval[ph]);
+		while (p->due[ph] <= now)
+		{
+			p->due[ph] += p->period;
+		}
+	}
+}
+
+void phases_report(phases * p)
+{
+	histogram * h;
+	int i;
+	for (i = 0; i < PHASE_COUNT; i++)
+	{
+		h = &p->total[i];
+		if (h->count == 0)
+		{
+			continue;
+		}
+		printf("phases: %-7s min %.3f ms, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms (%lu samples)\n",
+			phase_names[i],
+			h->min / 1000000.0,
+			histogram_mean(h) / 1000000.0,
+			histogram_percentile(h, 50.0) / 1000000.0,
+			histogram_percentile(h, 99.0) / 1000000.0,
+			h->max / 1000000.0,
+			(unsigned long) h->count
+		);
+	}
+}
+
+void phases_shutdown(phases * p)
+{
+	const uint64_t now = timing_now();
+	int i;
+	if (p->csv)
+	{
+		/* every thread is done by now, so the rows for what's left over can be written from here */
+		for (i = 0; i < PHASE_COUNT; i++)
+		{
+			if (p->interval[i].count > 0)
+			{
+				phases_write_row(p, (phase) i, now);
+			}
+		}
+		fclose(p->csv);
+		p->csv = NULL;
+	}
+}
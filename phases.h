@@ -0,0 +1,55 @@
+#ifndef PHASES_H
+#define PHASES_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+/* the parts a frame's time is split into, each one only ever recorded by one thread */
+typedef enum phase
+{
+	PHASE_EVENTS, /* presentation thread, handling X events */
+	PHASE_CORE, /* emulation thread, ClownMDEmu_Iterate less the scanline conversion done inside it */
+	PHASE_MIX, /* emulation thread, Mixer_End and resampling */
+	PHASE_CONVERT, /* emulation thread, scanline conversion, scaling and clearing undrawn lines */
+	PHASE_UPLOAD, /* presentation thread, sending a frame to the X server */
+	PHASE_AUDIO, /* emulation thread, queueing the frame's audio */
+	PHASE_SLEEP, /* emulation thread, waiting for the next frame's deadline */
+	PHASE_COUNT
+} phase;
+
+typedef struct phases
+{
+	histogram total[PHASE_COUNT];
+	histogram interval[PHASE_COUNT]; /* since the last csv row for the phase */
+	uint64_t due[PHASE_COUNT]; /* when the next csv row for the phase is written */
+	uint64_t start;
+	uint64_t period; /* between csv rows, in nanoseconds */
+	FILE * csv; /* NULL if not writing one */
+} phases;
+
+/*
+ * prepares per-phase histograms, which are fixed-size so recording never allocates
+ * csv_path names a file to write each phase's statistics to every period_s seconds, or NULL
+ * returns true on success, otherwise false
+ */
+int phases_init(phases * p, const char * csv_path, unsigned int period_s);
+
+/*
+ * records ns nanoseconds spent in a phase, only from the thread that owns it
+ * now is the current timing_now(), a csv row for the phase is written if one is due
+ */
+void phases_add(phases * p, phase ph, uint64_t ns, uint64_t now);
+
+/*
+ * prints min/mean/p50/p99/max for each phase that was recorded
+ */
+void phases_report(phases * p);
+
+/*
+ * writes the csv rows for anything recorded since the last ones and closes the file, once nothing is recording
+ */
+void phases_shutdown(phases * p);
+
+#endif /* PHASES_H */
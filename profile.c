@@ -0,0 +1,125 @@
+#include "profile.h"
+#include "timing.h"
+
+#include <stdio.h>
+
+typedef struct profile_counter
+{
+	unsigned long calls; /* this frame */
+	uint64_t ns; /* this frame */
+	unsigned long total_calls;
+	uint64_t total_ns;
+	uint64_t max_ns; /* worst single frame */
+} profile_counter;
+
+/* NOTE: global variables! the ClownCD callbacks have no user data to find them through */
+static profile_counter profile_counters[PROFILE_CALLBACK_COUNT];
+static unsigned long profile_frames;
+
+/* named after the fields they're assigned to in emulator_init() */
+static const char * const profile_names[PROFILE_CALLBACK_COUNT] = {
+	"scanline_rendered",
+	"colour_updated",
+	"input_requested",
+	"fm_audio_to_be_generated",
+	"psg_audio_to_be_generated",
+	"pcm_audio_to_be_generated",
+	"cdda_audio_to_be_generated",
+	"cd_seeked",
+	"cd_sector_read",
+	"cd_track_seeked",
+	"cd_audio_read",
+	"save_file_opened_for_reading",
+	"save_file_read",
+	"save_file_opened_for_writing",
+	"save_file_written",
+	"save_file_closed",
+	"save_file_removed",
+	"save_file_size_obtained",
+	"clowncd open",
+	"clowncd close",
+	"clowncd read",
+	"clowncd write",
+	"clowncd tell",
+	"clowncd seek"
+};
+
+uint64_t profile_begin(void)
+{
+	return timing_now();
+}
+
+void profile_end(profile_callback cb, uint64_t start)
+{
+	profile_counters[cb].calls++;
+	profile_counters[cb].ns += timing_now() - start;
+}
+
+void profile_frame(void)
+{
+	profile_counter * c;
+	int i;
+	for (i = 0; i < PROFILE_CALLBACK_COUNT; i++)
+	{
+		c = &profile_counters[i];
+		c->total_calls += c->calls;
+		c->total_ns += c->ns;
+		if (c->ns > c->max_ns)
+		{
+			c->max_ns = c->ns;
+		}
+		c->calls = 0;
+		c->ns = 0;
+	}
+	profile_frames++;
+}
+
+void profile_report(void)
+{
+	int order[PROFILE_CALLBACK_COUNT];
+	profile_counter * c;
+	int i;
+	int j;
+	int cb;
+	
+	if (profile_frames == 0)
+	{
+		return;
+	}
+	/* calls from before the first frame, such as opening the cd, still count */
+	for (i = 0; i < PROFILE_CALLBACK_COUNT; i++)
+	{
+		profile_counters[i].total_calls += profile_counters[i].calls;
+		profile_counters[i].total_ns += profile_counters[i].ns;
+		profile_counters[i].calls = 0;
+		profile_counters[i].ns = 0;
+	}
+	
+	for (i = 0; i < PROFILE_CALLBACK_COUNT; i++)
+	{
+		cb = i;
+		for (j = i; j > 0 && profile_counters[order[j - 1]].total_ns < profile_counters[cb].total_ns; j--)
+		{
+			order[j] = order[j - 1];
+		}
+		order[j] = cb;
+	}
+	
+	printf("profile: %lu frames, callback time includes any callbacks made from within it\n", profile_frames);
+	printf("profile: %-28s %12s %12s %12s %10s\n", "callback", "calls/frame", "us/frame", "max us", "ns/call");
+	for (i = 0; i < PROFILE_CALLBACK_COUNT; i++)
+	{
+		c = &profile_counters[order[i]];
+		if (c->total_calls == 0)
+		{
+			continue;
+		}
+		printf("profile: %-28s %12.2f %12.3f %12.3f %10.0f\n",
+			profile_names[order[i]],
+			(double) c->total_calls / profile_frames,
+			(double) c->total_ns / profile_frames / 1000.0,
+			(double) c->max_ns / 1000.0,
+			(double) c->total_ns / c->total_calls
+		);
+	}
+}
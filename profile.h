@@ -0,0 +1,53 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+/* every callback handed to the core and to ClownCD, which are only wrapped in PROFILE_CALLBACKS builds */
+typedef enum profile_callback
+{
+	PROFILE_SCANLINE_RENDERED,
+	PROFILE_COLOUR_UPDATED,
+	PROFILE_INPUT_REQUESTED,
+	PROFILE_FM_AUDIO,
+	PROFILE_PSG_AUDIO,
+	PROFILE_PCM_AUDIO,
+	PROFILE_CDDA_AUDIO,
+	PROFILE_CD_SEEKED,
+	PROFILE_CD_SECTOR_READ,
+	PROFILE_CD_TRACK_SEEKED,
+	PROFILE_CD_AUDIO_READ,
+	PROFILE_SAVE_FILE_OPENED_FOR_READING,
+	PROFILE_SAVE_FILE_READ,
+	PROFILE_SAVE_FILE_OPENED_FOR_WRITING,
+	PROFILE_SAVE_FILE_WRITTEN,
+	PROFILE_SAVE_FILE_CLOSED,
+	PROFILE_SAVE_FILE_REMOVED,
+	PROFILE_SAVE_FILE_SIZE_OBTAINED,
+	PROFILE_CLOWNCD_OPEN,
+	PROFILE_CLOWNCD_CLOSE,
+	PROFILE_CLOWNCD_READ,
+	PROFILE_CLOWNCD_WRITE,
+	PROFILE_CLOWNCD_TELL,
+	PROFILE_CLOWNCD_SEEK,
+	PROFILE_CALLBACK_COUNT
+} profile_callback;
+
+/*
+ * returns the time a callback starts, to be handed to profile_end() once it returns
+ * only ever called from one thread at a time, which the core and ClownCD already guarantee
+ */
+uint64_t profile_begin(void);
+void profile_end(profile_callback cb, uint64_t start);
+
+/*
+ * folds the calls made since the last frame into the totals, once per emulated frame
+ */
+void profile_frame(void);
+
+/*
+ * prints calls and time per frame for each callback that was called, busiest first
+ */
+void profile_report(void);
+
+#endif /* PROFILE_H */
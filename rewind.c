@@ -0,0 +1,308 @@
+#include "rewind.h"
+#include "lz.h"
+#include "atomic.h"
+#include "timing.h"
+#include "trace.h"
+
+#include <string.h>
+
+/* room for this many deltas per MiB of budget, static scenes make for tiny deltas */
+#define REWIND_ENTRIES_PER_MB 256
+
+static void rewind_xor(unsigned char * dst, const unsigned char * a, const unsigned char * b, size_t size)
+{
+	size_t i;
+	size_t words = size / sizeof(unsigned long);
+	unsigned long x;
+	unsigned long y;
+	
+	/* memcpy keeps this free of alignment and aliasing trouble, and compiles down to plain loads */
+	for (i = 0; i < words; i++)
+	{
+		memcpy(&x, a + i * sizeof(x), sizeof(x));
+		memcpy(&y, b + i * sizeof(y), sizeof(y));
+		x ^= y;
+		memcpy(dst + i * sizeof(x), &x, sizeof(x));
+	}
+	for (i = words * sizeof(unsigned long); i < size; i++)
+	{
+		dst[i] = a[i] ^ b[i];
+	}
+}
+
+static void rewind_evict_oldest(rewind_buffer * r)
+{
+	r->entry_first = (r->entry_first + 1) % r->entry_capacity;
+	r->entry_count--;
+	r->evicted++;
+}
+
+/* appends a compressed delta to the arena, throwing away the oldest ones to make room, called with the lock held */
+static void rewind_push(rewind_buffer * r, const unsigned char * data, size_t size)
+{
+	rewind_entry * e;
+	
+	if (size > r->arena_size)
+	{
+		return;
+	}
+	if (r->entry_count == r->entry_capacity)
+	{
+		rewind_evict_oldest(r);
+	}
+	if (r->arena_head + size > r->arena_size)
+	{
+		/* wrap around, anything between here and the end is from the previous lap and therefore oldest */
+		while (r->entry_count > 0 && r->entries[r->entry_first].offset >= r->arena_head)
+		{
+			rewind_evict_oldest(r);
+		}
+		r->arena_head = 0;
+	}
+	while (r->entry_count > 0 && r->entries[r->entry_first].offset >= r->arena_head && r->entries[r->entry_first].offset < r->arena_head + size)
+	{
+		rewind_evict_oldest(r);
+	}
+	
+	e = &r->entries[(r->entry_first + r->entry_count) % r->entry_capacity];
+	e->offset = r->arena_head;
+	e->size = size;
+	memcpy(r->arena + e->offset, data, size);
+	r->arena_head += size;
+	r->entry_count++;
+}
+
+static void * rewind_thread(void * arg)
+{
+	rewind_buffer * r = (rewind_buffer *) arg;
+	emulator_state * slot;
+	unsigned int tail;
+	size_t size;
+	int quit;
+	
+	trace_thread_name("rewind");
+	for (;;)
+	{
+		pthread_mutex_lock(&r->lock);
+		while (!r->quit && atomic_get(&r->staging_head) == r->staging_tail)
+		{
+			pthread_cond_wait(&r->wake, &r->lock);
+		}
+		quit = r->quit;
+		pthread_mutex_unlock(&r->lock);
+		if (quit)
+		{
+			break;
+		}
+		
+		tail = r->staging_tail;
+		slot = &r->staging[tail % REWIND_STAGING_SLOTS];
+		TRACE_BEGIN("rewind_compress");
+		if (r->has_latest)
+		{
+			rewind_xor(r->delta, (const unsigned char *) slot, (const unsigned char *) r->latest, sizeof(emulator_state));
+			size = lz_compress(r->delta, sizeof(emulator_state), r->compressed, r->compressed_capacity);
+			pthread_mutex_lock(&r->lock);
+			rewind_push(r, r->compressed, size);
+			r->raw_bytes += sizeof(emulator_state);
+			r->packed_bytes += size;
+			pthread_mutex_unlock(&r->lock);
+		}
+		memcpy(r->latest, slot, sizeof(emulator_state));
+		r->has_latest = 1;
+		TRACE_END("rewind_compress");
+		
+		pthread_mutex_lock(&r->lock);
+		atomic_set(&r->staging_tail, tail + 1);
+		pthread_cond_signal(&r->drained);
+		pthread_mutex_unlock(&r->lock);
+	}
+	return NULL;
+}
+
+int rewind_init(rewind_buffer * r, size_t budget_bytes, unsigned int interval)
+{
+	memset(r, 0, sizeof(rewind_buffer));
+	r->interval = interval > 0 ? interval : 1;
+	r->arena_size = budget_bytes;
+	r->entry_capacity = budget_bytes / (1024 * 1024) * REWIND_ENTRIES_PER_MB;
+	if (r->entry_capacity < REWIND_ENTRIES_PER_MB)
+	{
+		r->entry_capacity = REWIND_ENTRIES_PER_MB;
+	}
+	r->compressed_capacity = lz_bound(sizeof(emulator_state));
+	
+	r->staging = (emulator_state *) malloc(REWIND_STAGING_SLOTS * sizeof(emulator_state));
+	r->latest = (emulator_state *) malloc(sizeof(emulator_state));
+	r->delta = (unsigned char *) malloc(sizeof(emulator_state));
+	r->compressed = (unsigned char *) malloc(r->compressed_capacity);
+	r->arena = (unsigned char *) malloc(r->arena_size);
+	r->entries = (rewind_entry *) malloc(r->entry_capacity * sizeof(rewind_entry));
+	if (!r->staging || !r->latest || !r->delta || !r->compressed || !r->arena || !r->entries)
+	{
+		warn("unable to alloc rewind buffer\n");
+		goto fail;
+	}
+	
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->wake, NULL);
+	pthread_cond_init(&r->drained, NULL);
+	if (pthread_create(&r->thread, NULL, rewind_thread, r) != 0)
+	{
+		warn("unable to start rewind thread\n");
+		pthread_cond_destroy(&r->drained);
+		pthread_cond_destroy(&r->wake);
+		pthread_mutex_destroy(&r->lock);
+		goto fail;
+	}
+	r->init = 1;
+	return 1;
+fail:
+	free(r->staging);
+	free(r->latest);
+	free(r->delta);
+	free(r->compressed);
+	free(r->arena);
+	free(r->entries);
+	return 0;
+}
+
+void rewind_capture(rewind_buffer * r, emulator * emu)
+{
+	unsigned int head;
+	uint64_t start;
+	
+	if (!r->init)
+	{
+		return;
+	}
+	r->frames++;
+	if (r->countdown > 0)
+	{
+		r->countdown--;
+		return;
+	}
+	r->countdown = r->interval - 1;
+	
+	head = r->staging_head;
+	if (head - atomic_get(&r->staging_tail) >= REWIND_STAGING_SLOTS)
+	{
+		r->dropped++;
+		return;
+	}
+	start = timing_now();
+	emulator_capture_state(emu, &r->staging[head % REWIND_STAGING_SLOTS]);
+	r->capture_ns += timing_now() - start;
+	r->captures++;
+	
+	pthread_mutex_lock(&r->lock);
+	atomic_set(&r->staging_head, head + 1);
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+}
+
+int rewind_step(rewind_buffer * r, emulator * emu)
+{
+	rewind_entry * e;
+	size_t size;
+	
+	if (!r->init)
+	{
+		return 0;
+	}
+	
+	pthread_mutex_lock(&r->lock);
+	while (atomic_get(&r->staging_tail) != r->staging_head)
+	{
+		pthread_cond_wait(&r->drained, &r->lock);
+	}
+	if (!r->has_latest)
+	{
+		pthread_mutex_unlock(&r->lock);
+		return 0;
+	}
+	
+	emulator_restore_state(emu, r->latest);
+	if (r->entry_count > 0)
+	{
+		/* undo the newest delta, leaving the snapshot before it as the newest */
+		e = &r->entries[(r->entry_first + r->entry_count - 1) % r->entry_capacity];
+		size = lz_decompress(r->arena + e->offset, e->size, r->delta, sizeof(emulator_state));
+		if (size == sizeof(emulator_state))
+		{
+			rewind_xor((unsigned char *) r->latest, (const unsigned char *) r->latest, r->delta, sizeof(emulator_state));
+			r->arena_head = e->offset;
+			r->entry_count--;
+		}
+		else
+		{
+			/* every older snapshot is reached through this delta, so the history ends here */
+			warn("rewind history corrupt, discarding %lu older snapshots\n", (unsigned long) r->entry_count);
+			r->evicted += r->entry_count;
+			r->entry_count = 0;
+			r->arena_head = 0;
+		}
+	}
+	/* the next snapshot starts a new countdown from here */
+	r->countdown = r->interval - 1;
+	pthread_mutex_unlock(&r->lock);
+	return 1;
+}
+
+void rewind_report(rewind_buffer * r, double mean_frame_ns)
+{
+	double capture;
+	
+	if (!r->init)
+	{
+		return;
+	}
+	pthread_mutex_lock(&r->lock);
+	printf("rewind: %lu snapshots of %lu KiB, %lu dropped, %lu evicted\n",
+		r->captures,
+		(unsigned long) (sizeof(emulator_state) / 1024),
+		r->dropped,
+		r->evicted
+	);
+	printf("rewind: %lu deltas held in %lu KiB, compression ratio %.1f:1\n",
+		(unsigned long) r->entry_count,
+		(unsigned long) (r->arena_size / 1024),
+		r->packed_bytes > 0 ? (double) r->raw_bytes / r->packed_bytes : 0.0
+	);
+	pthread_mutex_unlock(&r->lock);
+	if (r->frames > 0)
+	{
+		capture = (double) r->capture_ns / r->frames;
+		if (mean_frame_ns > capture)
+		{
+			printf("rewind: capture cost %.3f ms per frame, %.1f%% of emulation\n", capture / 1000000.0, capture * 100.0 / (mean_frame_ns - capture));
+		}
+		else
+		{
+			printf("rewind: capture cost %.3f ms per frame\n", capture / 1000000.0);
+		}
+	}
+}
+
+void rewind_shutdown(rewind_buffer * r)
+{
+	if (!r->init)
+	{
+		return;
+	}
+	pthread_mutex_lock(&r->lock);
+	r->quit = 1;
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	pthread_cond_destroy(&r->drained);
+	pthread_cond_destroy(&r->wake);
+	pthread_mutex_destroy(&r->lock);
+	free(r->staging);
+	free(r->latest);
+	free(r->delta);
+	free(r->compressed);
+	free(r->arena);
+	free(r->entries);
+	r->init = 0;
+}
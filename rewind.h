@@ -0,0 +1,98 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+
+/* snapshots that may be waiting for the compression thread at once */
+#define REWIND_STAGING_SLOTS 4
+
+#define REWIND_DEFAULT_BUDGET_MB 64
+
+/* where a compressed delta lives in the arena */
+typedef struct rewind_entry
+{
+	size_t offset;
+	size_t size;
+} rewind_entry;
+
+/*
+ * rewind history, kept as the newest snapshot in full plus compressed xor deltas going back in time
+ * the emulation thread only copies the state into a staging slot, xoring and compressing is done by its own thread
+ * once the memory budget is used up the oldest deltas are thrown away
+ */
+typedef struct rewind_buffer
+{
+	int init;
+	unsigned int interval; /* frames between snapshots */
+	unsigned int countdown;
+	
+	/* snapshots waiting to be compressed, filled by the emulation thread */
+	emulator_state * staging;
+	unsigned int staging_head; /* atomic, written by the emulation thread */
+	unsigned int staging_tail; /* atomic, written by the compression thread */
+	
+	/* compressed deltas in a circular arena, oldest first */
+	unsigned char * arena;
+	size_t arena_size;
+	size_t arena_head; /* where the next delta goes */
+	rewind_entry * entries;
+	size_t entry_capacity;
+	size_t entry_first;
+	size_t entry_count;
+	
+	emulator_state * latest; /* newest snapshot in full, the deltas lead back from here */
+	int has_latest;
+	unsigned char * delta;
+	unsigned char * compressed;
+	size_t compressed_capacity;
+	
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; /* a snapshot was staged, or it's time to quit */
+	pthread_cond_t drained; /* the compression thread has caught up */
+	int quit;
+	
+	/* statistics */
+	unsigned long frames;
+	unsigned long captures;
+	unsigned long dropped; /* snapshots skipped because the compression thread fell behind */
+	unsigned long evicted;
+	uint64_t capture_ns;
+	uint64_t raw_bytes;
+	uint64_t packed_bytes;
+} rewind_buffer;
+
+/*
+ * allocates budget_bytes of history and starts the compression thread
+ * a snapshot is taken every interval frames
+ * returns true on success, otherwise false
+ */
+int rewind_init(rewind_buffer * r, size_t budget_bytes, unsigned int interval);
+
+/*
+ * called by the emulation thread once per frame, takes a snapshot if one is due
+ * never blocks on compression, if every staging slot is busy the snapshot is dropped
+ */
+void rewind_capture(rewind_buffer * r, emulator * emu);
+
+/*
+ * steps the emulator back to the previous snapshot, waiting for pending snapshots to be compressed first
+ * the first step after capturing goes back to the newest snapshot, and once the history runs out
+ * every step goes back to the oldest one
+ * returns false if there are no snapshots at all
+ */
+int rewind_step(rewind_buffer * r, emulator * emu);
+
+/*
+ * prints snapshot size, compression ratio, history length and the per-frame cost of capturing
+ * mean_frame_ns is the mean frame time including capturing, 0 if unknown
+ */
+void rewind_report(rewind_buffer * r, double mean_frame_ns);
+
+void rewind_shutdown(rewind_buffer * r);
+
+#endif /* REWIND_H */
@@ -0,0 +1,75 @@
+#include "ring_buffer.h"
+#include "atomic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int ring_buffer_init(ring_buffer * rb, size_t min_size)
+{
+	memset(rb, 0, sizeof(ring_buffer));
+	rb->size = 1;
+	while (rb->size < min_size)
+	{
+		rb->size <<= 1;
+	}
+	rb->data = (unsigned char *) malloc(rb->size);
+	if (!rb->data)
+	{
+		rb->size = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void ring_buffer_free(ring_buffer * rb)
+{
+	free(rb->data);
+	rb->data = NULL;
+	rb->size = 0;
+}
+
+size_t ring_buffer_used(ring_buffer * rb)
+{
+	return atomic_get(&rb->head) - atomic_get(&rb->tail);
+}
+
+size_t ring_buffer_space(ring_buffer * rb)
+{
+	return rb->size - ring_buffer_used(rb);
+}
+
+size_t ring_buffer_write(ring_buffer * rb, const void * src, size_t bytes)
+{
+	size_t head = rb->head;
+	size_t space = rb->size - (head - atomic_get(&rb->tail));
+	size_t offset;
+	size_t first;
+	if (bytes > space)
+	{
+		bytes = space;
+	}
+	offset = head & (rb->size - 1);
+	first = rb->size - offset < bytes ? rb->size - offset : bytes;
+	memcpy(rb->data + offset, src, first);
+	memcpy(rb->data, (const unsigned char *) src + first, bytes - first);
+	atomic_set(&rb->head, head + bytes);
+	return bytes;
+}
+
+size_t ring_buffer_read(ring_buffer * rb, void * dst, size_t bytes)
+{
+	size_t tail = rb->tail;
+	size_t used = atomic_get(&rb->head) - tail;
+	size_t offset;
+	size_t first;
+	if (bytes > used)
+	{
+		bytes = used;
+	}
+	offset = tail & (rb->size - 1);
+	first = rb->size - offset < bytes ? rb->size - offset : bytes;
+	memcpy(dst, rb->data + offset, first);
+	memcpy((unsigned char *) dst + first, rb->data, bytes - first);
+	atomic_set(&rb->tail, tail + bytes);
+	return bytes;
+}
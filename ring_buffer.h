@@ -0,0 +1,48 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stddef.h>
+
+/*
+ * lock-free single-producer/single-consumer byte ring buffer
+ * head and tail only ever increase and are masked on use, so full and empty are never ambiguous
+ */
+typedef struct ring_buffer
+{
+	unsigned char * data;
+	size_t size; /* always a power of 2 */
+	size_t head; /* atomic, total bytes written, only advanced by the producer */
+	size_t tail; /* atomic, total bytes read, only advanced by the consumer */
+} ring_buffer;
+
+/*
+ * allocates a ring buffer holding at least min_size bytes
+ * returns true on success, otherwise false
+ */
+int ring_buffer_init(ring_buffer * rb, size_t min_size);
+
+void ring_buffer_free(ring_buffer * rb);
+
+/*
+ * gets the number of bytes waiting to be read
+ */
+size_t ring_buffer_used(ring_buffer * rb);
+
+/*
+ * gets the number of bytes that can be written without overwriting unread data
+ */
+size_t ring_buffer_space(ring_buffer * rb);
+
+/*
+ * writes up to bytes bytes, producer side only
+ * returns the number of bytes written
+ */
+size_t ring_buffer_write(ring_buffer * rb, const void * src, size_t bytes);
+
+/*
+ * reads up to bytes bytes, consumer side only
+ * returns the number of bytes read
+ */
+size_t ring_buffer_read(ring_buffer * rb, void * dst, size_t bytes);
+
+#endif /* RING_BUFFER_H */
@@ -0,0 +1,390 @@
+#include "savestate.h"
+#include "lz.h"
+#include "atomic.h"
+#include "file.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#define SAVESTATE_VERSION 1
+#define SAVESTATE_SECTIONS 3
+#define SAVESTATE_HEADER_SIZE (8 + 4 * 3 + SAVESTATE_SECTIONS * 4 * 2)
+
+/* 32-bit FNV-1a, part of the file format, so it mustn't follow whatever hash the rest of the emulator uses */
+#define SAVESTATE_FNV_BASIS 2166136261U
+#define SAVESTATE_FNV_PRIME 16777619U
+
+static const char savestate_magic[8] = "CMDESTZ";
+static const char savestate_legacy_magic[8] = "CMDEFSS";
+
+typedef struct savestate_section
+{
+	size_t offset;
+	size_t size;
+	const char * name;
+} savestate_section;
+
+static const savestate_section savestate_sections[SAVESTATE_SECTIONS] = {
+	{ offsetof(emulator_state, state), sizeof(ClownMDEmu_StateBackup), "core" },
+	{ offsetof(emulator_state, cd), sizeof(CDReader_StateBackup), "cd" },
+	{ offsetof(emulator_state, colors), sizeof(palette), "palette" }
+};
+
+static void savestate_put32(unsigned char * p, uint32_t v)
+{
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+	p[2] = (unsigned char) (v >> 16);
+	p[3] = (unsigned char) (v >> 24);
+}
+
+static uint32_t savestate_get32(const unsigned char * p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* hashes the raw sections one after the other, so a state is checked the same way however it was stored */
+static uint32_t savestate_checksum(const emulator_state * state)
+{
+	uint32_t checksum = SAVESTATE_FNV_BASIS;
+	const unsigned char * p;
+	size_t n;
+	int i;
+	for (i = 0; i < SAVESTATE_SECTIONS; i++)
+	{
+		p = (const unsigned char *) state + savestate_sections[i].offset;
+		for (n = 0; n < savestate_sections[i].size; n++)
+		{
+			checksum = (checksum ^ p[n]) * SAVESTATE_FNV_PRIME;
+		}
+	}
+	return checksum;
+}
+
+size_t savestate_bound(void)
+{
+	size_t bound = SAVESTATE_HEADER_SIZE;
+	int i;
+	for (i = 0; i < SAVESTATE_SECTIONS; i++)
+	{
+		bound += lz_bound(savestate_sections[i].size);
+	}
+	return bound;
+}
+
+size_t savestate_encode(const emulator_state * state, unsigned char * dst, size_t dst_capacity)
+{
+	const unsigned char * raw;
+	unsigned char * field;
+	size_t used;
+	size_t size;
+	size_t packed;
+	int i;
+	
+	if (dst_capacity < SAVESTATE_HEADER_SIZE)
+	{
+		return 0;
+	}
+	memcpy(dst, savestate_magic, sizeof(savestate_magic));
+	savestate_put32(dst + 8, SAVESTATE_VERSION);
+	savestate_put32(dst + 12, SAVESTATE_SECTIONS);
+	savestate_put32(dst + 16, savestate_checksum(state));
+	used = SAVESTATE_HEADER_SIZE;
+	for (i = 0; i < SAVESTATE_SECTIONS; i++)
+	{
+		raw = (const unsigned char *) state + savestate_sections[i].offset;
+		size = savestate_sections[i].size;
+		packed = lz_compress(raw, size, dst + used, dst_capacity - used);
+		if (packed == 0 || packed >= size)
+		{
+			/* incompressible, keep it as it is */
+			if (dst_capacity - used < size)
+			{
+				return 0;
+			}
+			memcpy(dst + used, raw, size);
+			packed = size;
+		}
+		field = dst + 20 + i * 8;
+		savestate_put32(field, (uint32_t) size);
+		savestate_put32(field + 4, (uint32_t) packed);
+		used += packed;
+	}
+	return used;
+}
+
+int savestate_decode(const unsigned char * src, size_t src_size, emulator_state * state)
+{
+	unsigned char * raw;
+	const unsigned char * field;
+	size_t used;
+	size_t size;
+	size_t packed;
+	uint32_t version;
+	uint32_t sections;
+	int i;
+	
+	if (src_size == sizeof(savestate_legacy_magic) + sizeof(ClownMDEmu_StateBackup) + sizeof(CDReader_StateBackup) + sizeof(palette)
+		&& memcmp(src, savestate_legacy_magic, sizeof(savestate_legacy_magic)) == 0)
+	{
+		src += sizeof(savestate_legacy_magic);
+		for (i = 0; i < SAVESTATE_SECTIONS; i++)
+		{
+			memcpy((unsigned char *) state + savestate_sections[i].offset, src, savestate_sections[i].size);
+			src += savestate_sections[i].size;
+		}
+		return 1;
+	}
+	
+	if (src_size < SAVESTATE_HEADER_SIZE || memcmp(src, savestate_magic, sizeof(savestate_magic)) != 0)
+	{
+		printf("state file signature invalid\n");
+		return 0;
+	}
+	version = savestate_get32(src + 8);
+	sections = savestate_get32(src + 12);
+	if (version > SAVESTATE_VERSION)
+	{
+		printf("state file is version %lu, newer than the %d this build reads\n", (unsigned long) version, SAVESTATE_VERSION);
+		return 0;
+	}
+	if (sections != SAVESTATE_SECTIONS)
+	{
+		printf("state file has %lu sections, expected %d\n", (unsigned long) sections, SAVESTATE_SECTIONS);
+		return 0;
+	}
+	used = SAVESTATE_HEADER_SIZE;
+	for (i = 0; i < SAVESTATE_SECTIONS; i++)
+	{
+		field = src + 20 + i * 8;
+		size = savestate_get32(field);
+		packed = savestate_get32(field + 4);
+		if (size != savestate_sections[i].size)
+		{
+			/* the raw structs change shape between core versions, there's no converting them */
+			printf("state file %s section is %lu bytes, this build expects %lu\n", savestate_sections[i].name, (unsigned long) size, (unsigned long) savestate_sections[i].size);
+			return 0;
+		}
+		if (packed > src_size - used)
+		{
+			printf("state file truncated in %s section\n", savestate_sections[i].name);
+			return 0;
+		}
+		raw = (unsigned char *) state + savestate_sections[i].offset;
+		if (packed == size)
+		{
+			memcpy(raw, src + used, size);
+		}
+		else if (lz_decompress(src + used, packed, raw, size) != size)
+		{
+			printf("state file %s section is corrupt\n", savestate_sections[i].name);
+			return 0;
+		}
+		used += packed;
+	}
+	if (savestate_checksum(state) != savestate_get32(src + 16))
+	{
+		printf("state file checksum mismatch\n");
+		return 0;
+	}
+	return 1;
+}
+
+int savestate_load(const char * path, emulator_state * state)
+{
+	unsigned char * buf;
+	size_t size;
+	int ret;
+	if (!file_exists(path))
+	{
+		printf("state file %s does not exist\n", path);
+		return 0;
+	}
+	if (!file_load_to_buffer(path, &buf, &size))
+	{
+		printf("unable to load state file %s\n", path);
+		return 0;
+	}
+	ret = savestate_decode(buf, size, state);
+	free(buf);
+	return ret;
+}
+
+/* writes a complete file beside path, then renames it over path */
+static int savestate_write_file(const char * path, const unsigned char * data, size_t size)
+{
+	FILE * f;
+	char * tmp;
+	int ok;
+	
+	tmp = (char *) malloc(strlen(path) + sizeof(".tmp"));
+	if (!tmp)
+	{
+		printf("unable to alloc state file path\n");
+		return 0;
+	}
+	sprintf(tmp, "%s.tmp", path);
+	f = file_open_truncate(tmp);
+	if (!f)
+	{
+		printf("failed to save state to %s\n", tmp);
+		free(tmp);
+		return 0;
+	}
+	ok = file_write_bytes(data, size, f) == size;
+	/* the data has to be on disk before the rename is, or a crash could leave an empty state behind */
+	ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+	ok = file_close(f) && ok;
+	if (!ok)
+	{
+		printf("state write error on %s\n", tmp);
+		remove(tmp);
+		free(tmp);
+		return 0;
+	}
+	if (rename(tmp, path) != 0)
+	{
+		printf("unable to rename %s to %s\n", tmp, path);
+		remove(tmp);
+		free(tmp);
+		return 0;
+	}
+	free(tmp);
+	return 1;
+}
+
+static void * savestate_thread(void * arg)
+{
+	savestate_writer * w = (savestate_writer *) arg;
+	unsigned int tail;
+	char * path;
+	size_t size;
+	int quit;
+	
+	trace_thread_name("savestate");
+	for (;;)
+	{
+		pthread_mutex_lock(&w->lock);
+		while (!w->quit && atomic_get(&w->staging_head) == w->staging_tail)
+		{
+			pthread_cond_wait(&w->wake, &w->lock);
+		}
+		/* anything already staged is still written when quitting */
+		quit = w->quit && atomic_get(&w->staging_head) == w->staging_tail;
+		pthread_mutex_unlock(&w->lock);
+		if (quit)
+		{
+			break;
+		}
+		
+		tail = w->staging_tail;
+		path = w->paths[tail % SAVESTATE_STAGING_SLOTS];
+		TRACE_BEGIN("savestate_write");
+		size = savestate_encode(&w->staging[tail % SAVESTATE_STAGING_SLOTS], w->packed, w->packed_capacity);
+		if (size > 0 && savestate_write_file(path, w->packed, size))
+		{
+			printf("state written to %s, %.1f KiB compressed %.1f:1\n",
+				path,
+				size / 1024.0,
+				(double) sizeof(emulator_state) / size
+			);
+		}
+		TRACE_END("savestate_write");
+		free(path);
+		w->paths[tail % SAVESTATE_STAGING_SLOTS] = NULL;
+		
+		pthread_mutex_lock(&w->lock);
+		atomic_set(&w->staging_tail, tail + 1);
+		pthread_cond_signal(&w->drained);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+int savestate_init(savestate_writer * w)
+{
+	memset(w, 0, sizeof(savestate_writer));
+	w->packed_capacity = savestate_bound();
+	w->staging = (emulator_state *) malloc(SAVESTATE_STAGING_SLOTS * sizeof(emulator_state));
+	w->packed = (unsigned char *) malloc(w->packed_capacity);
+	if (!w->staging || !w->packed)
+	{
+		warn("unable to alloc save state buffers\n");
+		goto fail;
+	}
+	
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->wake, NULL);
+	pthread_cond_init(&w->drained, NULL);
+	if (pthread_create(&w->thread, NULL, savestate_thread, w) != 0)
+	{
+		warn("unable to start save state thread\n");
+		pthread_cond_destroy(&w->drained);
+		pthread_cond_destroy(&w->wake);
+		pthread_mutex_destroy(&w->lock);
+		goto fail;
+	}
+	w->init = 1;
+	return 1;
+fail:
+	free(w->staging);
+	free(w->packed);
+	return 0;
+}
+
+void savestate_queue(savestate_writer * w, const emulator_state * state, const char * path)
+{
+	unsigned int head;
+	char * copy;
+	
+	if (!w->init)
+	{
+		return;
+	}
+	copy = (char *) malloc(strlen(path) + 1);
+	if (!copy)
+	{
+		printf("unable to alloc state file path\n");
+		return;
+	}
+	strcpy(copy, path);
+	
+	head = w->staging_head;
+	pthread_mutex_lock(&w->lock);
+	while (head - atomic_get(&w->staging_tail) >= SAVESTATE_STAGING_SLOTS)
+	{
+		/* saves are never dropped, only a burst of them faster than the disk can take waits here */
+		pthread_cond_wait(&w->drained, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	
+	memcpy(&w->staging[head % SAVESTATE_STAGING_SLOTS], state, sizeof(emulator_state));
+	w->paths[head % SAVESTATE_STAGING_SLOTS] = copy;
+	
+	pthread_mutex_lock(&w->lock);
+	atomic_set(&w->staging_head, head + 1);
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void savestate_shutdown(savestate_writer * w)
+{
+	if (!w->init)
+	{
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	w->quit = 1;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_cond_destroy(&w->drained);
+	pthread_cond_destroy(&w->wake);
+	pthread_mutex_destroy(&w->lock);
+	free(w->staging);
+	free(w->packed);
+	w->init = 0;
+}
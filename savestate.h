@@ -0,0 +1,92 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+
+/* saves that may be waiting for the writer thread at once */
+#define SAVESTATE_STAGING_SLOTS 2
+
+/*
+ * save state files, a versioned header followed by each section of an emulator_state compressed on its own
+ * the header holds each section's raw and compressed lengths and a checksum of the raw data
+ *
+ *   0  magic "CMDESTZ\0"
+ *   8  version
+ *  12  section count
+ *  16  checksum, 32-bit FNV-1a of the raw sections in order
+ *  20  raw length, compressed length, for each section
+ *
+ * every field is a little-endian 32-bit integer, a section whose compressed length equals its raw length is stored as is
+ * files in the original format, the raw structs after the magic "CMDEFSS\0", are still loaded
+ */
+
+/*
+ * saves state files in the background
+ * the caller only copies the state into a staging slot, compressing and writing is done by its own thread
+ */
+typedef struct savestate_writer
+{
+	int init;
+	
+	/* saves waiting to be written, filled by one thread at a time */
+	emulator_state * staging;
+	char * paths[SAVESTATE_STAGING_SLOTS];
+	unsigned int staging_head; /* atomic, written by the thread queueing saves */
+	unsigned int staging_tail; /* atomic, written by the writer thread */
+	
+	unsigned char * packed;
+	size_t packed_capacity;
+	
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; /* a save was staged, or it's time to quit */
+	pthread_cond_t drained; /* the writer thread has caught up */
+	int quit;
+} savestate_writer;
+
+/*
+ * gets the largest possible size of a state file
+ */
+size_t savestate_bound(void);
+
+/*
+ * writes state to dst in the format above
+ * returns the number of bytes written, or 0 if it doesn't fit in dst_capacity
+ */
+size_t savestate_encode(const emulator_state * state, unsigned char * dst, size_t dst_capacity);
+
+/*
+ * reads a state file's contents, in either format, into state
+ * returns true on success, otherwise false, having said why
+ */
+int savestate_decode(const unsigned char * src, size_t src_size, emulator_state * state);
+
+/*
+ * loads a state file into state, synchronously
+ * returns true on success, otherwise false, having said why
+ */
+int savestate_load(const char * path, emulator_state * state);
+
+/*
+ * starts the writer thread
+ * returns true on success, otherwise false
+ */
+int savestate_init(savestate_writer * w);
+
+/*
+ * copies state and queues it to be written to path
+ * the file is written to path.tmp first and renamed over path once it's complete, so a crash never leaves half a state
+ * only waits if every staging slot is still being written
+ */
+void savestate_queue(savestate_writer * w, const emulator_state * state, const char * path);
+
+/*
+ * writes anything still queued and stops the writer thread
+ */
+void savestate_shutdown(savestate_writer * w);
+
+#endif /* SAVESTATE_H */
@@ -0,0 +1,110 @@
+#include "slots.h"
+#include "timing.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int slots_init(state_slots * s, unsigned int count, savestate_writer * writer, const char * base_path)
+{
+	unsigned int i;
+	memset(s, 0, sizeof(state_slots));
+	s->count = count;
+	s->pool = (emulator_state *) malloc(count * sizeof(emulator_state));
+	if (!s->pool)
+	{
+		printf("unable to alloc save state slots\n");
+		return 0;
+	}
+	if (!writer || !base_path)
+	{
+		return 1;
+	}
+	
+	/* slot 0 keeps the name of the single quick save there used to be */
+	for (i = 0; i < count; i++)
+	{
+		s->paths[i] = (char *) malloc(strlen(base_path) + 2);
+		if (!s->paths[i])
+		{
+			printf("unable to alloc save state slot paths\n");
+			slots_shutdown(s);
+			return 0;
+		}
+		if (i == 0)
+		{
+			strcpy(s->paths[i], base_path);
+		}
+		else
+		{
+			sprintf(s->paths[i], "%s%u", base_path, i);
+		}
+	}
+	s->writer = writer;
+	return 1;
+}
+
+void slots_save(state_slots * s, unsigned int slot, emulator * emu)
+{
+	uint64_t start = timing_now();
+	emulator_capture_state(emu, &s->pool[slot]);
+	s->filled[slot] = 1;
+	s->dirty[slot] = s->writer ? 1 : 0;
+	s->saved[slot] = timing_now();
+	logger_printf(LOGGER_INFO, "state saved to slot %u in %.3f ms\n", slot, (s->saved[slot] - start) / 1000000.0);
+}
+
+int slots_load(state_slots * s, unsigned int slot, emulator * emu)
+{
+	uint64_t start;
+	if (!s->filled[slot])
+	{
+		if (!s->paths[slot])
+		{
+			logger_printf(LOGGER_INFO, "slot %u is empty\n", slot);
+			return 0;
+		}
+		/* the file is only read once, from then on the slot lives in memory */
+		if (!savestate_load(s->paths[slot], &s->pool[slot]))
+		{
+			return 0;
+		}
+		s->filled[slot] = 1;
+	}
+	start = timing_now();
+	emulator_restore_state(emu, &s->pool[slot]);
+	logger_printf(LOGGER_INFO, "state loaded from slot %u in %.3f ms\n", slot, (timing_now() - start) / 1000000.0);
+	return 1;
+}
+
+void slots_persist(state_slots * s, uint64_t now)
+{
+	unsigned int i;
+	for (i = 0; i < s->count; i++)
+	{
+		/* waiting for a slot to settle means a burst of saves to it is only written once */
+		if (s->dirty[i] && now - s->saved[i] >= SLOTS_PERSIST_DELAY_NS)
+		{
+			savestate_queue(s->writer, &s->pool[i], s->paths[i]);
+			s->dirty[i] = 0;
+		}
+	}
+}
+
+void slots_shutdown(state_slots * s)
+{
+	unsigned int i;
+	for (i = 0; i < s->count; i++)
+	{
+		if (s->dirty[i])
+		{
+			savestate_queue(s->writer, &s->pool[i], s->paths[i]);
+		}
+		free(s->paths[i]);
+		s->paths[i] = NULL;
+	}
+	free(s->pool);
+	s->pool = NULL;
+	s->count = 0;
+}
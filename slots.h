@@ -0,0 +1,59 @@
+#ifndef SLOTS_H
+#define SLOTS_H
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "savestate.h"
+
+/* one slot per number key */
+#define SLOTS_MAX 10
+
+/* a saved slot is only written to disk once it's gone this long without being saved again */
+#define SLOTS_PERSIST_DELAY_NS ((uint64_t) 2 * 1000000000)
+
+/*
+ * numbered quick save slots, held in memory so loading one is just a copy back into the emulator
+ * slots can also be kept in state files, written lazily and only read the first time an empty slot is loaded
+ * only ever used from the emulation thread, until slots_shutdown()
+ */
+typedef struct state_slots
+{
+	emulator_state * pool; /* count states, allocated up front */
+	unsigned int count;
+	int filled[SLOTS_MAX];
+	int dirty[SLOTS_MAX]; /* saved since it was last handed to the writer */
+	uint64_t saved[SLOTS_MAX]; /* when each dirty slot was last saved */
+	char * paths[SLOTS_MAX]; /* NULL when kept in memory only */
+	savestate_writer * writer; /* NULL when kept in memory only */
+} state_slots;
+
+/*
+ * allocates count slots
+ * base_path is the state file for slot 0, others add their number to it, or NULL to keep the slots in memory only
+ * returns true on success, otherwise false
+ */
+int slots_init(state_slots * s, unsigned int count, savestate_writer * writer, const char * base_path);
+
+/*
+ * copies the emulator's state into a slot
+ */
+void slots_save(state_slots * s, unsigned int slot, emulator * emu);
+
+/*
+ * puts the emulator back to the state in a slot
+ * returns true on success, otherwise false if the slot is empty
+ */
+int slots_load(state_slots * s, unsigned int slot, emulator * emu);
+
+/*
+ * called by the emulation thread once per frame, hands slots that have settled to the writer
+ */
+void slots_persist(state_slots * s, uint64_t now);
+
+/*
+ * hands every slot not yet written to the writer, which must still be running, and frees the slots
+ */
+void slots_shutdown(state_slots * s);
+
+#endif /* SLOTS_H */
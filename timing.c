@@ -0,0 +1,167 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L /* clock_nanosleep() */
+#endif
+
+#include "timing.h"
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+/* clock_nanosleep() doesn't support CLOCK_MONOTONIC_RAW, so the pacer sticks to CLOCK_MONOTONIC */
+uint64_t timing_monotonic(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * BILLION + (uint64_t) ts.tv_nsec;
+}
+
+static void pacer_sleep_until(uint64_t target)
+{
+	struct timespec ts;
+#ifdef TIMER_ABSTIME
+	ts.tv_sec = target / BILLION;
+	ts.tv_nsec = target % BILLION;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	{
+		/* interrupted by a signal, go back to sleep, any other error means sleeping won't work at all */
+	}
+#else
+	uint64_t now = timing_monotonic();
+	if (target > now)
+	{
+		ts.tv_sec = (target - now) / BILLION;
+		ts.tv_nsec = (target - now) % BILLION;
+		nanosleep(&ts, NULL);
+	}
+#endif
+}
+
+uint64_t timing_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t) ts.tv_sec * BILLION + (uint64_t) ts.tv_nsec;
+}
+
+void pacer_init(pacer * p, uint64_t numerator, uint64_t denominator, uint64_t spin)
+{
+	memset(p, 0, sizeof(pacer));
+	p->period = numerator / denominator;
+	p->period_frac = numerator % denominator;
+	p->period_den = denominator;
+	p->spin = spin;
+	p->deadline = timing_monotonic() + p->period;
+}
+
+void pacer_wait(pacer * p, unsigned int flags)
+{
+	uint64_t now;
+	uint64_t late;
+	int missed;
+	
+	now = timing_monotonic();
+	missed = now >= p->deadline;
+	if (!missed)
+	{
+		if (p->deadline - now > p->spin)
+		{
+			pacer_sleep_until(p->deadline - p->spin);
+		}
+		do
+		{
+			now = timing_monotonic();
+		}
+		while (now < p->deadline);
+	}
+	
+	late = now - p->deadline;
+	p->late = late;
+	if (!(flags & PACER_UNTIMED))
+	{
+		if (missed)
+		{
+			p->missed++;
+		}
+		p->frames++;
+		p->jitter_sum += (double) late;
+		p->jitter_sum_sq += (double) late * (double) late;
+		if (late > p->jitter_max)
+		{
+			p->jitter_max = late;
+		}
+	}
+	
+	/* advance by exactly one period so oversleeping doesn't accumulate as drift */
+	p->deadline += p->period;
+	p->frac += p->period_frac;
+	if (p->frac >= p->period_den)
+	{
+		p->frac -= p->period_den;
+		p->deadline++;
+	}
+	
+	/* too far behind to catch up without a burst of frames, so start over from now */
+	if (now > p->deadline && !(flags & PACER_KEEP_SCHEDULE))
+	{
+		p->deadline = now + p->period;
+		if (!(flags & PACER_UNTIMED))
+		{
+			p->resyncs++;
+		}
+	}
+}
+
+unsigned long pacer_behind(pacer * p)
+{
+	return (unsigned long) (p->late / p->period);
+}
+
+int pacer_lock(pacer * p, uint64_t vblank, uint64_t refresh)
+{
+	uint64_t target;
+	int64_t error;
+	
+	/* following a 75 Hz or 144 Hz display would run the game that much faster, so only nudge the phase of a matching one */
+	if (fabs((double) refresh - (double) p->period) > (double) p->period * PACER_LOCK_TOLERANCE)
+	{
+		return 0;
+	}
+	
+	/* start each frame half a refresh after a vblank, leaving the other half to emulate and present it before the next */
+	target = vblank + refresh / 2;
+	while (target + refresh / 2 < p->deadline)
+	{
+		target += refresh;
+	}
+	error = (int64_t) (target - p->deadline);
+	
+	/* close the gap gradually, so one late notification doesn't yank the schedule around */
+	p->deadline += error / 8;
+	return 1;
+}
+
+void pacer_report(pacer * p)
+{
+	double mean;
+	double stddev;
+	if (p->frames == 0)
+	{
+		printf("pacing: no frames recorded\n");
+		return;
+	}
+	mean = p->jitter_sum / p->frames;
+	stddev = p->jitter_sum_sq / p->frames - mean * mean;
+	stddev = stddev > 0.0 ? sqrt(stddev) : 0.0;
+	printf("pacing: %.6f ms period, %lu frames, %lu missed deadlines, %lu resyncs\n",
+		(p->period + (double) p->period_frac / p->period_den) / 1000000.0,
+		(unsigned long) p->frames,
+		(unsigned long) p->missed,
+		(unsigned long) p->resyncs
+	);
+	printf("pacing: wakeup jitter mean %.1f us, stddev %.1f us, max %.1f us\n",
+		mean / 1000.0,
+		stddev / 1000.0,
+		(double) p->jitter_max / 1000.0
+	);
+}
@@ -0,0 +1,82 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* CLOCK_MONOTONIC_RAW is linux-only */
+#ifndef CLOCK_MONOTONIC_RAW
+#define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
+#endif
+
+#define BILLION 1000000000L
+
+/* pacer_wait() flags */
+#define PACER_KEEP_SCHEDULE 1 /* don't resync when falling behind, the caller will skip frames to catch up */
+#define PACER_UNTIMED 2 /* leave the frame out of the jitter measurements, such as while fast-forwarding */
+
+/* how far a display's refresh may be from the game's frame rate and still be locked to, within what audio resampling can absorb */
+#define PACER_LOCK_TOLERANCE 0.005
+
+typedef struct pacer
+{
+	uint64_t deadline; /* absolute CLOCK_MONOTONIC time of the next frame, in nanoseconds */
+	uint64_t period; /* whole nanoseconds per frame */
+	uint64_t period_frac; /* fractional nanoseconds per frame, over period_den */
+	uint64_t period_den;
+	uint64_t frac;
+	uint64_t spin; /* nanoseconds to busy-wait before each deadline */
+	uint64_t late; /* how far past its deadline the last wait started, 0 if it was on time */
+	
+	/* jitter measurements, i.e. how late each wakeup was relative to its deadline */
+	uint64_t frames;
+	uint64_t missed; /* frames that were already past their deadline */
+	uint64_t resyncs; /* times the schedule was reset after falling more than a frame behind */
+	uint64_t jitter_max;
+	double jitter_sum;
+	double jitter_sum_sq;
+} pacer;
+
+/*
+ * reads the monotonic clock
+ * returns the current time in nanoseconds
+ */
+uint64_t timing_now(void);
+
+/*
+ * reads CLOCK_MONOTONIC, which is what the pacer and the X server's timestamps use
+ * returns the current time in nanoseconds
+ */
+uint64_t timing_monotonic(void);
+
+/*
+ * prepares a pacer for frames lasting (numerator / denominator) nanoseconds, starting now
+ * spin is the length of the busy-wait tail before each deadline in nanoseconds (0 to only sleep)
+ */
+void pacer_init(pacer * p, uint64_t numerator, uint64_t denominator, uint64_t spin);
+
+/*
+ * waits until the current frame's deadline, then schedules the next one
+ * flags is any combination of the PACER_ flags above
+ */
+void pacer_wait(pacer * p, unsigned int flags);
+
+/*
+ * returns how many whole periods the last wait started behind schedule, i.e. the number of frames to skip to catch up
+ */
+unsigned long pacer_behind(pacer * p);
+
+/*
+ * phase-locks the pacer to a display that refreshes every refresh nanoseconds, last at vblank
+ * (CLOCK_MONOTONIC nanoseconds), so frames are finished in time for each refresh
+ * returns true if locked, otherwise false, leaving the schedule alone, as the refresh rate is too far from the frame rate
+ */
+int pacer_lock(pacer * p, uint64_t vblank, uint64_t refresh);
+
+/*
+ * prints the measured pacing jitter
+ */
+void pacer_report(pacer * p);
+
+#endif /* TIMING_H */
@@ -0,0 +1,184 @@
+#include "trace.h"
+#include "atomic.h"
+#include "timing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct trace_event
+{
+	const char * name;
+	uint64_t time; /* timing_now() nanoseconds */
+	char phase; /* 'B' or 'E', as in the trace event format */
+} trace_event;
+
+typedef struct trace_buffer
+{
+	trace_event * events;
+	size_t count;
+	size_t dropped;
+	const char * thread_name;
+} trace_buffer;
+
+int trace_enabled; /* only changed while no other thread is running */
+
+/* NOTE: global variables! the core's callbacks have nowhere else to find them */
+static trace_buffer trace_buffers[TRACE_MAX_THREADS];
+static unsigned int trace_thread_count; /* atomic, buffers handed out so far */
+static char * trace_path;
+static uint64_t trace_start;
+static __thread trace_buffer * trace_local;
+static __thread int trace_local_full; /* out of buffers, don't keep trying */
+
+int trace_init(const char * path)
+{
+	trace_path = (char *) malloc(strlen(path) + 1);
+	if (!trace_path)
+	{
+		printf("unable to alloc trace path\n");
+		return 0;
+	}
+	strcpy(trace_path, path);
+	trace_start = timing_now();
+	trace_enabled = 1;
+	return 1;
+}
+
+/* hands the calling thread a buffer the first time it records something */
+static trace_buffer * trace_get_buffer(void)
+{
+	unsigned int index;
+	trace_event * events;
+	if (trace_local || trace_local_full)
+	{
+		return trace_local;
+	}
+	index = atomic_add(&trace_thread_count, 1);
+	if (index >= TRACE_MAX_THREADS)
+	{
+		trace_local_full = 1;
+		return NULL;
+	}
+	events = (trace_event *) malloc(TRACE_EVENTS_PER_THREAD * sizeof(trace_event));
+	if (!events)
+	{
+		trace_local_full = 1;
+		return NULL;
+	}
+	trace_buffers[index].events = events;
+	trace_local = &trace_buffers[index];
+	return trace_local;
+}
+
+static void trace_record(const char * name, char phase)
+{
+	trace_buffer * buf = trace_get_buffer();
+	if (!buf)
+	{
+		return;
+	}
+	if (buf->count == TRACE_EVENTS_PER_THREAD)
+	{
+		buf->dropped++;
+		return;
+	}
+	buf->events[buf->count].name = name;
+	buf->events[buf->count].time = timing_now();
+	buf->events[buf->count].phase = phase;
+	buf->count++;
+}
+
+void trace_begin(const char * name)
+{
+	trace_record(name, 'B');
+}
+
+void trace_end(const char * name)
+{
+	trace_record(name, 'E');
+}
+
+void trace_thread_name(const char * name)
+{
+	trace_buffer * buf;
+	if (!trace_enabled)
+	{
+		return;
+	}
+	buf = trace_get_buffer();
+	if (buf)
+	{
+		buf->thread_name = name;
+	}
+}
+
+void trace_shutdown(void)
+{
+	FILE * f;
+	trace_buffer * buf;
+	unsigned int threads;
+	unsigned int i;
+	size_t j;
+	size_t events;
+	size_t dropped;
+	
+	if (!trace_enabled)
+	{
+		return;
+	}
+	trace_enabled = 0;
+	threads = atomic_get(&trace_thread_count);
+	if (threads > TRACE_MAX_THREADS)
+	{
+		threads = TRACE_MAX_THREADS;
+	}
+	
+	f = fopen(trace_path, "w");
+	if (!f)
+	{
+		printf("unable to open %s for writing\n", trace_path);
+	}
+	else
+	{
+		fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"clownmdemu\"}}");
+		events = dropped = 0;
+		for (i = 0; i < threads; i++)
+		{
+			buf = &trace_buffers[i];
+			if (buf->thread_name)
+			{
+				fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", i + 1, buf->thread_name);
+			}
+			for (j = 0; j < buf->count; j++)
+			{
+				/* timestamps are microseconds, keeping the nanoseconds as decimals */
+				fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+					buf->events[j].name,
+					buf->events[j].phase,
+					i + 1,
+					(double) (buf->events[j].time - trace_start) / 1000.0
+				);
+			}
+			events += buf->count;
+			dropped += buf->dropped;
+		}
+		fprintf(f, "\n]}\n");
+		fclose(f);
+		printf("trace: %lu events from %u threads written to %s", (unsigned long) events, threads, trace_path);
+		if (dropped > 0)
+		{
+			printf(", %lu dropped once buffers filled", (unsigned long) dropped);
+		}
+		printf("\n");
+	}
+	
+	for (i = 0; i < threads; i++)
+	{
+		free(trace_buffers[i].events);
+		trace_buffers[i].events = NULL;
+	}
+	free(trace_path);
+	trace_path = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* threads that can record events, any more are ignored */
+#define TRACE_MAX_THREADS 16
+
+/* events each thread can hold before it starts dropping them */
+#define TRACE_EVENTS_PER_THREAD (512 * 1024)
+
+/* nonzero while recording, so call sites cost a single branch when tracing is off */
+extern int trace_enabled;
+
+#define TRACE_BEGIN(name) do { if (trace_enabled) trace_begin(name); } while (0)
+#define TRACE_END(name) do { if (trace_enabled) trace_end(name); } while (0)
+
+/*
+ * starts recording events, to be written to path as chrome trace event json by trace_shutdown()
+ * returns true on success, otherwise false
+ */
+int trace_init(const char * path);
+
+/*
+ * marks the start and end of a span on the calling thread, name must be a string literal
+ * each thread records into its own buffer, allocated on its first event, so nothing is shared or locked
+ */
+void trace_begin(const char * name);
+void trace_end(const char * name);
+
+/*
+ * names the calling thread in the trace
+ */
+void trace_thread_name(const char * name);
+
+/*
+ * writes the trace file once every thread that recorded events has stopped
+ */
+void trace_shutdown(void);
+
+#endif /* TRACE_H */
@@ -0,0 +1,30 @@
+#include "triple_buffer.h"
+#include "atomic.h"
+
+void triple_buffer_init(triple_buffer * tb)
+{
+	tb->back = 0;
+	tb->middle = 1;
+	tb->front = 2;
+}
+
+int triple_buffer_publish(triple_buffer * tb)
+{
+	unsigned int old = atomic_swap(&tb->middle, (unsigned int) tb->back | TRIPLE_BUFFER_FRESH);
+	tb->back = old & ~TRIPLE_BUFFER_FRESH;
+	return tb->back;
+}
+
+int triple_buffer_acquire(triple_buffer * tb, int * fresh)
+{
+	unsigned int old;
+	if (!(atomic_get(&tb->middle) & TRIPLE_BUFFER_FRESH))
+	{
+		*fresh = 0;
+		return tb->front;
+	}
+	old = atomic_swap(&tb->middle, (unsigned int) tb->front);
+	tb->front = old & ~TRIPLE_BUFFER_FRESH;
+	*fresh = 1;
+	return tb->front;
+}
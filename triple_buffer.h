@@ -0,0 +1,33 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+/*
+ * lock-free triple buffer handing whole frames from one producer to one consumer
+ * the producer never waits and the consumer always gets the newest complete frame
+ * only buffer indices (0-2) are exchanged, the buffers themselves live elsewhere
+ */
+
+#define TRIPLE_BUFFER_FRESH 4
+
+typedef struct triple_buffer
+{
+	int back; /* owned by the producer */
+	int front; /* owned by the consumer */
+	unsigned int middle; /* shared, index plus TRIPLE_BUFFER_FRESH if not yet consumed */
+} triple_buffer;
+
+void triple_buffer_init(triple_buffer * tb);
+
+/*
+ * publishes the back buffer as the newest frame
+ * returns the index of the buffer the producer should fill next
+ */
+int triple_buffer_publish(triple_buffer * tb);
+
+/*
+ * takes the newest frame if one was published since the last call
+ * returns the index of the front buffer, with *fresh set to whether it changed
+ */
+int triple_buffer_acquire(triple_buffer * tb, int * fresh);
+
+#endif /* TRIPLE_BUFFER_H */